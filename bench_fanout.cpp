@@ -0,0 +1,148 @@
+//////////////////////////////////////////////
+// FAN-OUT BENCHMARK
+//
+// Microbenchmark for the broadcast fan-out loop of tcp_epoll_server.cpp with
+// the connection table and output queues on the heap versus in the huge
+// page arena (--huge-pages).  Builds a client table the way a long running
+// server ends up with one, every connection's allocations interleaved with
+// other heap traffic, then times the per recipient work of
+// deliver_message(): find the subscribed clients and queue the message on
+// their output buffers.
+//   heap        - std allocator, nodes scattered over 4KB pages
+//   arena 4KB   - the arena with huge pages turned off (packing only)
+//   arena huge  - the arena on 2MB pages (hugetlb or transparent)
+// Each is timed for channel 0 (everybody) and channel 1 (every 4th client),
+// testing subscriptions on the connections themselves ("table") and in the
+// fan-out registry's arrays ("registry").
+//
+/////////////////////////////////////////////
+// Build instructions:
+// g++ -O2 bench_fanout.cpp -o bench_fanout -lpthread
+//
+// Run: ./bench_fanout [clients]   (default 100000)
+// (hugetlb pages need reserving first: echo 512 > /proc/sys/vm/nr_hugepages,
+//  otherwise transparent huge pages are used if enabled)
+//
+/////////////////////////////////////////////
+
+// pull in the server for its arena and connection state, without its main().
+#define TCP_EPOLL_SERVER_NO_MAIN
+#include "tcp_epoll_server.cpp"
+
+#include <iomanip>
+
+typedef unordered_map<int, client_connection, hash<int>, equal_to<int>,
+                      arena_allocator<pair<const int, client_connection>>> client_table;
+
+// fill the table in accept order.  Every connection is followed by some
+// unrelated allocations (messages, buffers, strings) that stay around, the
+// way they do in a server that has been running for a while.
+static void build_clients(client_table &clients, vector<int, arena_allocator<int>> &fd_list,
+                          vector<string> &noise, size_t count, unsigned seed) {
+  mt19937 rng(seed);
+  uniform_int_distribution<size_t> noise_len(64, 4096);
+  clients.reserve(count);
+  for ( size_t i = 0; i < count; ++i ) {
+    int fd = (int)i + 16;
+    client_connection &conn = clients[fd];
+    conn.fd = fd;
+    conn.channel_mask = ( i % 4 == 0 ) ? 3 : 1;
+    conn.out.reserve(256);
+    fd_list.push_back(fd);
+    for ( int n = 0; n < 3; ++n )
+      noise.push_back(string(noise_len(rng), 'x'));
+  }
+  // free some of it again, leaving holes between connections.
+  for ( size_t i = 0; i < noise.size(); i += 2 )
+    string().swap(noise[i]);
+}
+
+static void queue_message(client_connection &to, const string &msg) {
+  to.out.append(msg.data(), msg.size());
+  if ( to.out.size() > 192 ) // "written": keep the buffer, drop the bytes.
+    to.out.clear();
+}
+
+// one broadcast on channel, testing every client's connection.  Returns ns per client.
+static double fan_out(client_table &clients, const vector<int, arena_allocator<int>> &fd_list, int channel, const string &msg) {
+  uint64_t channel_bit = 1ull << channel;
+  auto start = chrono::steady_clock::now();
+  for ( auto fd : fd_list ) {
+    client_connection &to = clients[fd];
+    if ( ( to.channel_mask & channel_bit ) && !to.replaying )
+      queue_message(to, msg);
+  }
+  double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+  return ns / fd_list.size();
+}
+
+// the same through the registry, the way deliver_message() does it.
+static double fan_out(const fanout_registry &fanout, int channel, const string &msg) {
+  uint64_t channel_bit = 1ull << channel;
+  auto start = chrono::steady_clock::now();
+  for ( size_t i = 0, count = fanout.size(); i < count; ++i ) {
+    if ( !( fanout.mask(i) & channel_bit ) || ( fanout.flag(i) & fanout_registry::replaying ) )
+      continue;
+    queue_message(fanout.connection(i), msg);
+  }
+  double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+  return ns / fanout.size();
+}
+
+static double best_of(function<double()> fn) {
+  double best = 1e30;
+  for ( int round = 0; round < 20; ++round )
+    best = min(best, fn());
+  return best;
+}
+
+static double run(const char *name, huge_arena *arena, size_t count) {
+  connection_arena = arena;
+  double best = 1e30;
+  {
+    client_table clients;
+    vector<int, arena_allocator<int>> fd_list;
+    vector<string> noise;
+    build_clients(clients, fd_list, noise, count, 1);
+    fanout_registry fanout;
+    for ( auto fd : fd_list )
+      fanout.add(clients[fd]);
+    string msg(64, 'm');
+    msg.back() = '\n';
+    best = best_of([&] { return fan_out(clients, fd_list, 0, msg); });
+    double registry = best_of([&] { return fan_out(fanout, 0, msg); });
+    double table_1 = best_of([&] { return fan_out(clients, fd_list, 1, msg); });
+    double registry_1 = best_of([&] { return fan_out(fanout, 1, msg); });
+    std::cout << "  " << setw(11) << left << name << right << fixed << setprecision(2)
+              << "  channel 0: table " << setw(6) << best << " registry " << setw(6) << registry
+              << "   channel 1: table " << setw(6) << table_1 << " registry " << setw(6) << registry_1 << " ns/client";
+    if ( arena != nullptr )
+      std::cout << "   (" << ( arena->bytes_used() >> 20 ) << "MB used, " << ( arena->huge_kb() >> 10 ) << "MB on huge pages)";
+    std::cout << "\n";
+  }
+  connection_arena = nullptr;
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = argc > 1 ? atoi(argv[1]) : 100000;
+  if ( count == 0 )
+    count = 100000;
+  std::cout << count << " clients, sizeof(client_connection) = " << sizeof(client_connection) << "\n";
+
+  // room for the nodes, buckets, fd list and output buffers.
+  size_t arena_bytes = count * 2048 + ( 64 << 20 );
+  huge_arena small_pages, huge_pages;
+  if ( !small_pages.map(arena_bytes, true, false) || !huge_pages.map(arena_bytes, true, true) ) {
+    std::cerr << "[E] cannot map " << ( arena_bytes >> 20 ) << "MB arenas\n";
+    return 1;
+  }
+  std::cout << "huge pages: " << ( huge_pages.uses_hugetlb() ? "hugetlb" : "transparent" ) << "\n";
+
+  double heap = run("heap", nullptr, count);
+  double packed = run("arena 4KB", &small_pages, count);
+  double huge = run("arena huge", &huge_pages, count);
+  std::cout << "arena 4KB vs heap: " << setprecision(2) << heap / packed << "x, "
+            << "arena huge vs heap: " << heap / huge << "x\n";
+  return 0;
+}
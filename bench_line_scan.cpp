@@ -0,0 +1,113 @@
+//////////////////////////////////////////////
+// LINE SCAN BENCHMARK
+//
+// Microbenchmark for the newline scanner used by the line framer in
+// tcp_epoll_server.cpp.  Splits a buffer of newline terminated messages
+// into lines with each implementation and prints throughput:
+//   scalar  - byte at a time loop
+//   memchr  - glibc memchr()
+//   sse2    - 32 bytes per step (x86-64)
+//   avx2    - 64 bytes per step (x86-64 with AVX2)
+//
+/////////////////////////////////////////////
+// Build instructions:
+// g++ -O2 bench_line_scan.cpp -o bench_line_scan -lpthread
+//
+// Run: ./bench_line_scan [buffer MB]   (default 64)
+//
+/////////////////////////////////////////////
+
+// pull in the server for its scanners, without its main().
+#define TCP_EPOLL_SERVER_NO_MAIN
+#include "tcp_epoll_server.cpp"
+
+#include <random>
+#include <iomanip>
+
+static size_t find_newline_memchr(const char *p, size_t n) {
+  const void *hit = memchr(p, '\n', n);
+  return hit == nullptr ? n : (const char*)hit - p;
+}
+
+// split the whole buffer the way frame_lines() does, return the line count
+// (and a checksum of line lengths so the work can't be optimized away).
+static size_t split_lines(newline_scanner scan, const string &buf, size_t &checksum) {
+  size_t lines = 0;
+  size_t pos = 0;
+  while ( pos < buf.size() ) {
+    size_t nl = scan(buf.data() + pos, buf.size() - pos);
+    checksum += nl;
+    ++lines;
+    pos += nl + 1;
+  }
+  return lines;
+}
+
+// messages of random length around avg_len, each ending in "\r\n".
+static string make_buffer(size_t total, size_t avg_len, unsigned seed) {
+  mt19937 rng(seed);
+  uniform_int_distribution<size_t> len_dist(avg_len / 2, avg_len + avg_len / 2);
+  uniform_int_distribution<int> char_dist(' ', '~');
+  string buf;
+  buf.reserve(total + avg_len * 2);
+  while ( buf.size() < total ) {
+    size_t len = max<size_t>(len_dist(rng), 2);
+    for ( size_t i = 0; i < len - 2; ++i )
+      buf.push_back((char)char_dist(rng));
+    buf += "\r\n";
+  }
+  return buf;
+}
+
+int main(int argc, char *argv[]) {
+  size_t total_mb = argc > 1 ? atoi(argv[1]) : 64;
+  if ( total_mb == 0 )
+    total_mb = 64;
+
+  vector<pair<const char*, newline_scanner>> scanners;
+  scanners.push_back(make_pair("scalar", find_newline_scalar));
+  scanners.push_back(make_pair("memchr", find_newline_memchr));
+#if defined(__x86_64__)
+  scanners.push_back(make_pair("sse2", find_newline_sse2));
+  if ( __builtin_cpu_supports("avx2") )
+    scanners.push_back(make_pair("avx2", find_newline_avx2));
+  else
+    std::cout << "(no AVX2 on this CPU, skipping avx2)\n";
+#endif
+  std::cout << "server uses: " << ( find_newline == find_newline_scalar ? "scalar" :
+#if defined(__x86_64__)
+                                    find_newline == find_newline_avx2 ? "avx2" : "sse2"
+#else
+                                    "?"
+#endif
+                                  ) << "\n";
+
+  const size_t line_lengths[] = { 16, 80, 512, 4096, 65536 };
+  for ( auto avg_len : line_lengths ) {
+    string buf = make_buffer(total_mb << 20, avg_len, 1);
+    std::cout << "\naverage line " << avg_len << " bytes, " << total_mb << " MB\n";
+    size_t expect_lines = 0, expect_sum = 0;
+    for ( auto &s : scanners ) {
+      double best = 1e30;
+      size_t lines = 0, sum = 0;
+      for ( int run = 0; run < 5; ++run ) {
+        sum = 0;
+        auto start = chrono::steady_clock::now();
+        lines = split_lines(s.second, buf, sum);
+        double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = min(best, secs);
+      }
+      if ( expect_lines == 0 ) {
+        expect_lines = lines;
+        expect_sum = sum;
+      } else if ( lines != expect_lines || sum != expect_sum ) {
+        std::cerr << "[E] " << s.first << " disagrees with scalar (" << lines << " lines vs " << expect_lines << ")\n";
+        return 1;
+      }
+      std::cout << "  " << setw(7) << left << s.first << right << fixed << setprecision(2)
+                << setw(8) << buf.size() / best / 1e9 << " GB/s  "
+                << setw(8) << lines / best / 1e6 << " Mlines/s\n";
+    }
+  }
+  return 0;
+}
@@ -12,6 +12,20 @@
 /////////////////////////////////////////////
 // Build instructions:  (Linux only)
 // g++ tcp_epoll_server.cpp -o tcp_epoll_server -lpthread
+// (glibc older than 2.34 also needs -lanl for getaddrinfo_a())
+// (-O2 -DNDEBUG for production: drops the scratch arena's escape checks)
+//
+// With TLS support (OpenSSL 3, kernel TLS offload when the kernel has the "tls" ULP):
+// g++ -DTCP_SERVER_WITH_TLS tcp_epoll_server.cpp -o tcp_epoll_server -lpthread -lssl -lcrypto
+//
+// With message compression (either or both codecs, clients pick one with "compress <codec>"):
+// g++ -DTCP_SERVER_WITH_ZSTD -DTCP_SERVER_WITH_LZ4 tcp_epoll_server.cpp -o tcp_epoll_server -lpthread -lzstd -llz4
+//
+// Newline scanner microbenchmark (SSE2/AVX2 vs memchr vs scalar):
+// g++ -O2 bench_line_scan.cpp -o bench_line_scan -lpthread
+//
+// Fan-out microbenchmark (heap vs huge page arena, connections vs fan-out registry):
+// g++ -O2 bench_fanout.cpp -o bench_fanout -lpthread
 //
 /////////////////////////////////////////////
 // Quick Operation guide
@@ -28,6 +42,36 @@
 // Sending the message 'quit' followed by return will cause the tcp server to
 // close the session as well.
 //
+// Clients start out in the "default" channel.  Sending "join <name>" moves
+// the client's messages to channel <name> and subscribes it, "leave <name>"
+// unsubscribes.  Messages are only forwarded to subscribers of the channel.
+// With "--journal <dir>" every message is also journaled, "replay <seq>" sends
+// everything from sequence number <seq> on before live traffic resumes.
+// "--seq" tags broadcasts "[<channel>#<seq>] ", after a short disconnect
+// "since <channel> <seq>" resends what the client missed.
+//
+// By default the server listens dual-stack (IPv6 and IPv4) on all interfaces,
+// use "-b <host>" (repeatable) to pick bind addresses and "-p <port>" for the port.
+// "-u <path>" adds a unix domain socket for same-host clients ("socat - UNIX-CONNECT:<path>"),
+// "--no-tcp" serves only that socket.
+// "-s <secs>" prints a line of runtime metrics (connections, rates, drops) every <secs>.
+// "-a <port>" serves the same metrics over HTTP: "curl localhost:<port>/metrics" (Prometheus
+// text format), "curl localhost:<port>/healthz" and "curl localhost:<port>/latency" (event
+// loop latency histograms, also printed every <secs> with "-L <secs>").
+// "--client-rate" / "--channel-rate <msgs>[:<bytes>]" cap inbound traffic per second,
+// "--tls-port <p> --tls-cert <pem> --tls-key <pem>" adds a TLS listener (TLS builds only),
+// "-w" lets browsers connect too: new WebSocket("ws://localhost:9090/") on the same port,
+// "--upgrade-socket <path>" allows hot restarts: start the new binary with the same path
+// and it takes over listeners and connections from the running one, which exits.
+// "--peer-port <p>" and "--peer <host:port>" (repeatable) link servers into a federation:
+// broadcasts reach the clients of every linked server.  With "--channel-owners" (full mesh)
+// a server only receives the channels its clients subscribe to.
+// Clients of a build with zstd/LZ4 may send "compress zstd" or "compress lz4" to get every
+// message compressed ("--zstd-dict <file>" adds a trained dictionary, "dict" fetches it).
+// "--huge-pages <MB>" keeps connection state and output queues in one huge page arena
+// ("--huge-pages-prefault" faults it all in at startup, before clients arrive).
+// "./tcp_epoll_server -h" lists every option.
+//
 /////////////////////////////////////////////////////
 
 #include <vector>
@@ -45,6 +89,14 @@
 #include <memory>
 #include <algorithm>
 #include <sstream>
+#include <unordered_map>
+#include <deque>
+#include <queue>
+#include <functional>
+#include <bitset>
+#include <random>
+#include <fstream>
+#include <cassert>
 
 // linux headers for sockets and epoll
 #include <sys/epoll.h>
@@ -54,201 +106,5036 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+
+// signal handling
+#include <signal.h>
+
+// command line parsing
+#include <getopt.h>
+
+// SIMD for newline scanning and WebSocket payload unmasking.
+// SSE2 is part of the x86-64 baseline, AVX2 is only used after a CPUID check.
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// optional TLS, see build instructions above.
+#ifdef TCP_SERVER_WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+// optional message compression codecs, see "Message compression" below.
+#ifdef TCP_SERVER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TCP_SERVER_WITH_LZ4
+#include <lz4.h>
+#endif
+
+// default to search in std namespace.
+using namespace std;
+
+// used by main() loop to signal shutdown of server from OS signal.
+atomic<bool> AppRunning;
+
+void sig_handler(int signo) {
+  // shutdown on any signal received.
+  AppRunning.store(false);
+}
+
+// initial number of epoll events to handle in 1 go..
+// This is the max number of events the kernel will dispatch
+// to us per epoll_wait() call.. The event array grows from here
+// while batches come back full, see epoll_batch_sizer.
+constexpr int tcp_epoll_max_events = 32;
+
+////////////////////////////////////////////////////////////
+// Adaptive epoll batch size
+// Doubles the event array after a couple of consecutive saturated
+// epoll_wait() calls (more ready fds than we asked for) and halves it
+// again once a whole window of wakeups used no more than a quarter of it.
+// Bounded by [min_size, max_size].
+//
+class epoll_batch_sizer {
+  public:
+    static constexpr int grow_after = 2;     // consecutive full batches before growing
+    static constexpr int shrink_window = 64; // wakeups observed before considering a shrink
+
+    epoll_batch_sizer(int min_size, int max_size)
+      : min_size(max(1, min_size)), max_size(max(max(1, min_size), max_size)), current(this->min_size) {}
+
+    int size() const { return current; }
+
+    // feed the result of one epoll_wait(), returns the size for the next call.
+    int update(int n) {
+      if ( n >= current ) {
+        window_peak = current;
+        if ( ++saturated_run >= grow_after && current < max_size ) {
+          current = min(current * 2, max_size);
+          reset_window();
+        }
+        return current;
+      }
+      saturated_run = 0;
+      if ( n > window_peak )
+        window_peak = n;
+      if ( ++window_wakeups >= shrink_window ) {
+        if ( window_peak <= current / 4 && current > min_size )
+          current = max(current / 2, min_size);
+        reset_window();
+      }
+      return current;
+    }
+
+  private:
+    void reset_window() {
+      saturated_run = 0;
+      window_wakeups = 0;
+      window_peak = 0;
+    }
+    int min_size;
+    int max_size;
+    int current;
+    int saturated_run = 0;
+    int window_wakeups = 0;
+    int window_peak = 0;
+};
+
+////////////////////////////////////////////////////////////
+// Runtime metrics
+// Every reactor thread registers one metrics_slot and is the only thread
+// that ever writes to it, so updates are a relaxed load/store pair (no lock
+// prefix) and slots are cache line aligned so reactors never share a line.
+// Readers sum all slots with relaxed loads and never block the hot path.
+//
+enum metric_id {
+  metric_connections,     // gauge
+  metric_accepts,
+  metric_bytes_in,
+  metric_bytes_out,
+  metric_messages_in,
+  metric_messages_out,
+  metric_drops,
+  metric_epoll_wakeups,
+  metric_epoll_events,
+  metric_epoll_saturated,
+  metric_epoll_batch_size,  // gauge
+  metric_rejected,
+  metric_throttled,
+  metric_tls_handshakes,
+  metric_ktls_sessions,
+  metric_tls_writes,
+  metric_ws_upgrades,
+  metric_out_writes,
+  metric_out_queued,
+  metric_peer_links,
+  metric_peer_messages_in,
+  metric_peer_messages_out,
+  metric_peer_duplicates,
+  metric_peer_drops,
+  metric_peer_writes,
+  metric_compress_in,
+  metric_compress_out,
+  metric_count
+};
+
+struct metric_info {
+  const char *name;
+  const char *help;
+  bool gauge;
+};
+
+// names and help text, indexed by metric_id.
+const metric_info metric_table[metric_count] = {
+  { "connections",    "Currently connected clients.",                              true  },
+  { "accepts",        "Connections accepted.",                                     false },
+  { "bytes_in",       "Bytes read from clients.",                                  false },
+  { "bytes_out",      "Bytes written to clients.",                                 false },
+  { "messages_in",    "Messages received from clients.",                           false },
+  { "messages_out",   "Messages written to clients (one per recipient).",          false },
+  { "drops",          "Messages not (fully) written because the socket was full.", false },
+  { "epoll_wakeups",  "epoll_wait() calls that returned events.",                  false },
+  { "epoll_events",   "Events returned by epoll_wait().",                          false },
+  { "epoll_saturated", "epoll_wait() calls that filled the whole event array.",    false },
+  { "epoll_batch_size", "Current size of the epoll_wait() event array.",          true  },
+  { "rejected",       "Connections refused by admission control.",                 false },
+  { "throttled",      "Times a client was paused by inbound rate limits.",         false },
+  { "tls_handshakes", "Completed TLS handshakes.",                                 false },
+  { "ktls_sessions",  "TLS sessions handed to kernel TLS for sending.",            false },
+  { "tls_writes",     "SSL_write() calls (userspace TLS encryption passes).",      false },
+  { "ws_upgrades",    "Connections upgraded to WebSocket.",                        false },
+  { "out_writes",     "write() calls flushing coalesced output.",                  false },
+  { "out_queued",     "Bytes queued for clients, not yet written.",                true  },
+  { "peer_links",     "Peer links up (hello exchanged).",                          true  },
+  { "peer_messages_in", "Messages received from peers, duplicates included.",      false },
+  { "peer_messages_out", "Frames queued for peers (one per link).",                false },
+  { "peer_duplicates", "Peer messages dropped as already seen.",                   false },
+  { "peer_drops",     "Peer messages dropped because the link was backed up.",     false },
+  { "peer_writes",    "write() calls on peer links.",                              false },
+  { "compress_in",    "Message bytes compressed (once per broadcast and codec).",  false },
+  { "compress_out",   "Compressed bytes produced, headers included.",              false },
+};
+
+// monotonic nanoseconds, for phase timing and rate limits.
+static inline uint64_t trace_clock_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// max number of reactor threads that can register with one registry.
+constexpr int metrics_max_reactors = 16;
+
+struct alignas(64) metrics_slot {
+  array<atomic<int64_t>, metric_count> values;
+
+  metrics_slot() {
+    for ( auto &v : values )
+      v.store(0, memory_order_relaxed);
+  }
+  // single writer, no read-modify-write needed.
+  void add(metric_id id, int64_t n) {
+    values[id].store(values[id].load(memory_order_relaxed) + n, memory_order_relaxed);
+  }
+};
+
+// aggregated view of all slots at one point in time.
+struct metrics_snapshot {
+  chrono::steady_clock::time_point when;
+  array<int64_t, metric_count> values;
+
+  int64_t operator[](metric_id id) const { return values[id]; }
+  // per second rate of a counter since an earlier snapshot.
+  double rate(const metrics_snapshot &earlier, metric_id id) const {
+    double secs = chrono::duration<double>(when - earlier.when).count();
+    return secs > 0 ? (values[id] - earlier.values[id]) / secs : 0.0;
+  }
+};
+
+class metrics_registry {
+  public:
+    // hand out a slot owned by the calling reactor thread, nullptr when all
+    // are taken (a slot has a single writer, it can't be shared).
+    metrics_slot *register_reactor() {
+      int i = slots_used.load();
+      do {
+        if ( i >= metrics_max_reactors ) {
+          std::cerr << "[E] too many reactors for metrics registry (" << metrics_max_reactors << ")..\n";
+          return nullptr;
+        }
+      } while ( !slots_used.compare_exchange_weak(i, i + 1) );
+      return &slots[i];
+    }
+    // sum every registered slot.
+    metrics_snapshot snapshot() const {
+      metrics_snapshot snap;
+      snap.when = chrono::steady_clock::now();
+      snap.values.fill(0);
+      int used = slots_used.load();
+      for ( int i = 0; i < used; ++i )
+        for ( int m = 0; m < metric_count; ++m )
+          snap.values[m] += slots[i].values[m].load(memory_order_relaxed);
+      return snap;
+    }
+  private:
+    array<metrics_slot, metrics_max_reactors> slots;
+    atomic<int> slots_used{0};
+};
+
+////////////////////////////////////////////////////////////
+// Latency histogram
+// HDR style log-linear histogram.  Values below 2*sub_count get a bucket
+// each, above that every power of two is split into sub_count linear
+// buckets, so a value is never off by more than ~3% from its bucket.
+// Same single writer rule as metrics_slot: the reactor records, anybody
+// may read the relaxed atomic counts for a report.
+//
+class latency_histogram {
+  public:
+    static constexpr int sub_bits = 5;
+    static constexpr int sub_count = 1 << sub_bits;
+    static constexpr int max_bits = 40; // values are clamped below 2^40 (~18 minutes in ns)
+    static constexpr int bucket_count = (max_bits - sub_bits + 1) * sub_count;
+
+    latency_histogram() {
+      for ( auto &c : counts )
+        c.store(0, memory_order_relaxed);
+    }
+
+    void record(uint64_t value) {
+      if ( value >= (1ull << max_bits) )
+        value = (1ull << max_bits) - 1;
+      bump(counts[index_of(value)], 1);
+      bump(total, 1);
+      if ( value > max_value.load(memory_order_relaxed) )
+        max_value.store(value, memory_order_relaxed);
+    }
+
+    uint64_t count() const { return total.load(memory_order_relaxed); }
+    uint64_t max() const { return max_value.load(memory_order_relaxed); }
+
+    // smallest bucket upper bound that covers fraction p (0..1) of the samples.
+    uint64_t percentile(double p) const {
+      uint64_t n = count();
+      if ( n == 0 )
+        return 0;
+      uint64_t want = (uint64_t)(p * n + 0.5);
+      if ( want == 0 )
+        want = 1;
+      uint64_t seen = 0;
+      for ( int i = 0; i < bucket_count; ++i ) {
+        seen += counts[i].load(memory_order_relaxed);
+        if ( seen >= want )
+          return min(upper_bound_of(i), max());
+      }
+      return max();
+    }
+
+  private:
+    static void bump(atomic<uint64_t> &a, uint64_t n) {
+      a.store(a.load(memory_order_relaxed) + n, memory_order_relaxed);
+    }
+    static int index_of(uint64_t v) {
+      if ( v < 2 * sub_count )
+        return (int)v;
+      int msb = 63 - __builtin_clzll(v);
+      int shift = msb - sub_bits;
+      return (shift + 1) * sub_count + (int)((v >> shift) - sub_count);
+    }
+    static uint64_t upper_bound_of(int idx) {
+      if ( idx < 2 * sub_count )
+        return idx;
+      int shift = idx / sub_count - 1;
+      uint64_t top = idx % sub_count + sub_count;
+      return ((top + 1) << shift) - 1;
+    }
+
+    array<atomic<uint64_t>, bucket_count> counts;
+    atomic<uint64_t> total{0};
+    atomic<uint64_t> max_value{0};
+};
+
+// event loop tracing, one set per reactor.
+struct loop_trace {
+  latency_histogram batch_ns;          // processing time of one epoll_wait() batch
+  latency_histogram accept_ns;         // accept + welcome of one connection
+  latency_histogram read_ns;           // read() and message handling of one event
+  latency_histogram fanout_ns;         // forwarding one message to all recipients
+  latency_histogram events_per_wakeup; // events returned per epoll_wait() call
+};
+
+// render a snapshot in Prometheus text exposition format.
+string render_prometheus(const metrics_snapshot &snap) {
+  ostringstream oss;
+  for ( int m = 0; m < metric_count; ++m ) {
+    string name = string("tcp_server_") + metric_table[m].name + ( metric_table[m].gauge ? "" : "_total" );
+    oss << "# HELP " << name << " " << metric_table[m].help << "\n"
+        << "# TYPE " << name << " " << ( metric_table[m].gauge ? "gauge" : "counter" ) << "\n"
+        << name << " " << snap.values[m] << "\n";
+  }
+  return oss.str();
+}
+
+////////////////////////////////////////////////////////////
+// Socket option profile
+// Declarative set of socket options applied to the listener at
+// bind time and to every client socket at accept time.
+// Integer options set to -1 are left at the kernel default.
+//
+struct socket_profile {
+  bool tcp_nodelay = true;    // disable Nagle, small broadcast messages go out right away.
+  int sndbuf = -1;            // SO_SNDBUF in bytes.
+  int rcvbuf = -1;            // SO_RCVBUF in bytes.
+  bool tcp_quickack = false;  // TCP_QUICKACK, re-armed after every read (kernel clears it).
+  int notsent_lowat = -1;     // TCP_NOTSENT_LOWAT in bytes.
+  int defer_accept = -1;      // TCP_DEFER_ACCEPT in seconds (listener only).
+  int fastopen_qlen = -1;     // TCP_FASTOPEN pending queue length (listener only).
+  bool keepalive = false;     // SO_KEEPALIVE
+  int keepidle = -1;          // TCP_KEEPIDLE in seconds.
+  int keepintvl = -1;         // TCP_KEEPINTVL in seconds.
+  int keepcnt = -1;           // TCP_KEEPCNT probes.
+};
+
+////////////////////////////////////////////////////////////
+// Token bucket
+// rate tokens per second, up to burst tokens banked.  A rate of 0 means
+// unlimited.  Callers may take more than is available, the bucket then
+// goes negative and has to earn the debt back before it allows more.
+//
+struct token_bucket {
+  double rate = 0;
+  double burst = 0;
+  double tokens = 0;
+  uint64_t refill_ns = 0;
+
+  void configure(double new_rate, double new_burst, uint64_t now_ns) {
+    rate = new_rate;
+    // default: one second worth, but never less than the one token a
+    // message or byte needs, or rates below 1/s would never allow anything.
+    burst = new_burst > 0 ? new_burst : max(new_rate, 1.0);
+    tokens = burst;
+    refill_ns = now_ns;
+  }
+  bool limited() const { return rate > 0; }
+  void refill(uint64_t now_ns) {
+    if ( rate > 0 && now_ns > refill_ns )
+      tokens = min(burst, tokens + (now_ns - refill_ns) * 1e-9 * rate);
+    refill_ns = now_ns;
+  }
+  // at least need tokens left: one per message, one (any byte) for bytes.
+  bool allows(double need) const { return rate <= 0 || tokens >= need; }
+  void take(double n) {
+    if ( rate > 0 )
+      tokens -= n;
+  }
+  // nanoseconds until allows(need) becomes true.
+  uint64_t wait_ns(double need) const {
+    if ( allows(need) )
+      return 0;
+    return (uint64_t)((need - tokens) / rate * 1e9) + 1;
+  }
+};
+
+////////////////////////////////////////////////////////////
+// Message history ring
+// The last messages of a channel, kept for clients that join late and for
+// clients resuming after a short disconnect ("since").  Message
+// bytes live in one circular buffer and a power of two index ring points
+// into it, so storing a message is one memcpy plus one index slot and
+// nothing is allocated after configure().  A message never wraps around the
+// end of the buffer (the tail is skipped instead), so replay hands out each
+// message as one contiguous piece.  The oldest messages go when the index
+// is full, when their bytes are needed, or once they are older than max_age_ns.
+//
+class message_ring {
+  public:
+    void configure(size_t max_messages, size_t max_bytes, uint64_t max_age) {
+      size_t slots = 1;
+      while ( slots < max_messages )
+        slots <<= 1;
+      index.assign(max_messages > 0 ? slots : 0, entry());
+      limit = max_messages;
+      data.assign(max_messages > 0 ? max_bytes : 0, '\0');
+      max_age_ns = max_age;
+      head = tail = 0;
+      write_pos = 0;
+    }
+    bool enabled() const { return limit > 0 && !data.empty(); }
+    size_t size() const { return head - tail; }
+
+    void push(const char *buf, size_t len, uint64_t seq, uint64_t now_ns) {
+      if ( !enabled() )
+        return;
+      // too big to keep: forget everything older too, so the history never
+      // looks complete across the gap (a resume there has to resync).
+      if ( len > data.size() ) {
+        tail = head;
+        return;
+      }
+      uint64_t cap = data.size();
+      uint64_t start = write_pos;
+      if ( start % cap + len > cap )
+        start += cap - start % cap; // skip the tail, keep the message in one piece.
+      uint64_t end = start + len;
+      while ( size() > 0 && ( size() >= limit || end - oldest().pos > cap ) )
+        ++tail;
+      expire(now_ns);
+      memcpy(&data[start % cap], buf, len);
+      entry &e = index[head++ & ( index.size() - 1 )];
+      e.pos = start;
+      e.len = len;
+      e.seq = seq;
+      e.time_ns = now_ns;
+      write_pos = end;
+    }
+
+    // sequence number of the oldest message kept, 0 if there is none.
+    uint64_t oldest_seq(uint64_t now_ns) {
+      expire(now_ns);
+      return size() > 0 ? oldest().seq : 0;
+    }
+
+    // fn(seq, ptr, len) for every message from sequence number from_seq on
+    // that is still within max age, oldest first.
+    template <class F> void for_each(uint64_t now_ns, uint64_t from_seq, F fn) {
+      expire(now_ns);
+      for ( uint64_t i = tail; i < head; ++i ) {
+        const entry &e = index[i & ( index.size() - 1 )];
+        if ( e.seq >= from_seq )
+          fn(e.seq, &data[e.pos % data.size()], (size_t)e.len);
+      }
+    }
+
+  private:
+    struct entry {
+      uint64_t pos = 0;     // write_pos at the first byte, data index is pos % data.size()
+      uint64_t len = 0;
+      uint64_t seq = 0;     // the channel's sequence number of the message
+      uint64_t time_ns = 0;
+    };
+    const entry &oldest() const { return index[tail & ( index.size() - 1 )]; }
+    void expire(uint64_t now_ns) {
+      while ( max_age_ns > 0 && size() > 0 && now_ns - oldest().time_ns > max_age_ns )
+        ++tail;
+    }
+
+    vector<entry> index;
+    vector<char> data;
+    size_t limit = 0;            // max messages kept, at most index.size()
+    uint64_t max_age_ns = 0;     // 0 keeps messages regardless of age.
+    uint64_t head = 0, tail = 0; // index ring, entries [tail, head)
+    uint64_t write_pos = 0;      // running byte position of the next message
+};
+
+// max number of broadcast channels, each client keeps its subscriptions as a bit mask.
+constexpr int max_channels = 64;
+// longest channel name, it has to fit the journal's and the peer links' length fields.
+constexpr size_t max_channel_name = 255;
+
+// a broadcast channel.  Channel 0 ("default") exists from the start and every
+// client is subscribed to it on connect.
+struct channel_state {
+  string name;
+  token_bucket message_rate; // inbound limit shared by all publishers on the channel
+  token_bucket byte_rate;
+  message_ring history;      // recent messages, replayed to new subscribers.
+  uint64_t next_seq = 1;     // sequence number of the channel's next broadcast.
+  int subscribers = 0;       // listed local clients subscribed.
+  uint64_t interest_node = 0; // owner our subscribers are registered with, 0 for none.
+  vector<uint64_t> peer_subscribers; // nodes with subscribers, kept by the owner.
+};
+
+////////////////////////////////////////////////////////////
+// Admission table
+// Open addressing (linear probing) hash table keyed by the client IP,
+// IPv4 stored as v4-mapped IPv6 so both families share one 16 byte key.
+// Each entry tracks the open connection count and the connect rate token
+// bucket for that address.  The table doubles at 3/4 load, but first drops
+// idle entries (no connections and a full bucket) which carry no state.
+//
+class admission_table {
+  public:
+    typedef array<uint8_t, 16> key_type;
+    struct entry {
+      key_type key;
+      bool used = false;
+      uint32_t connections = 0;
+      double tokens = 0;
+      uint64_t refill_ns = 0; // last time tokens were topped up
+    };
+
+    admission_table(size_t initial_size = 1024) : slots(initial_size) {}
+
+    // existing entry for key, or nullptr.
+    entry *find(const key_type &key) {
+      size_t mask = slots.size() - 1;
+      for ( size_t i = hash(key) & mask; slots[i].used; i = (i + 1) & mask )
+        if ( slots[i].key == key )
+          return &slots[i];
+      return nullptr;
+    }
+
+    // entry for key, created with a full bucket if new.  Pointers are
+    // only valid until the next insert.
+    entry *find_or_insert(const key_type &key, double burst, double rate, uint64_t now_ns) {
+      entry *e = find(key);
+      if ( e != nullptr )
+        return e;
+      if ( (used + 1) * 4 > slots.size() * 3 )
+        rehash(burst, rate, now_ns);
+      size_t mask = slots.size() - 1;
+      size_t i = hash(key) & mask;
+      while ( slots[i].used )
+        i = (i + 1) & mask;
+      slots[i].used = true;
+      slots[i].key = key;
+      slots[i].connections = 0;
+      slots[i].tokens = burst;
+      slots[i].refill_ns = now_ns;
+      ++used;
+      return &slots[i];
+    }
+
+    size_t size() const { return used; }
+
+    // client address to table key.  false for non IP sockets.
+    static bool make_key(const struct sockaddr_storage &addr, key_type &key) {
+      key.fill(0);
+      if ( addr.ss_family == AF_INET ) {
+        key[10] = key[11] = 0xff;
+        memcpy(&key[12], &((const struct sockaddr_in*)&addr)->sin_addr, 4);
+        return true;
+      }
+      if ( addr.ss_family == AF_INET6 ) {
+        memcpy(key.data(), &((const struct sockaddr_in6*)&addr)->sin6_addr, 16);
+        return true;
+      }
+      return false;
+    }
+
+  private:
+    static size_t hash(const key_type &key) {
+      uint64_t a, b;
+      memcpy(&a, key.data(), 8);
+      memcpy(&b, key.data() + 8, 8);
+      uint64_t h = a * 0x9e3779b97f4a7c15ull ^ ( b + 0x632be59bd9b4e019ull );
+      h ^= h >> 33;
+      h *= 0xff51afd7ed558ccdull;
+      h ^= h >> 33;
+      return (size_t)h;
+    }
+
+    // rebuild without idle entries, growing if that did not free enough.
+    void rehash(double burst, double rate, uint64_t now_ns) {
+      vector<entry> live;
+      for ( auto &e : slots ) {
+        if ( !e.used )
+          continue;
+        bool refilled = rate <= 0 || e.tokens + (now_ns - e.refill_ns) * 1e-9 * rate >= burst;
+        if ( e.connections > 0 || !refilled )
+          live.push_back(e);
+      }
+      size_t size = slots.size();
+      while ( (live.size() + 1) * 2 > size )
+        size *= 2;
+      slots.assign(size, entry());
+      used = 0;
+      size_t mask = size - 1;
+      for ( auto &e : live ) {
+        size_t i = hash(e.key) & mask;
+        while ( slots[i].used )
+          i = (i + 1) & mask;
+        slots[i] = e;
+        ++used;
+      }
+    }
+
+    vector<entry> slots; // size is always a power of two.
+    size_t used = 0;
+};
+
+////////////////////////////////////////////////////////////
+// Message journal
+// Append-only log of every broadcast, split into fixed size segment files
+// that are mmap()ed, so appending is a memcpy and reading back is a pointer.
+//   <dir>/<first seq>.log  records: {seq, channel seq, len, channel name length}
+//                          name payload, 8 byte aligned, a zero seq marks the end.
+//   <dir>/<first seq>.idx  sparse index: {seq, offset} for the first record
+//                          at or after every index_interval bytes of the log.
+// A sequence number is found with a binary search over the segments, then
+// over the segment's index, then a short forward scan (< index_interval).
+// Replay walks the mapping with MADV_SEQUENTIAL and MADV_WILLNEED ahead of
+// the reader.  When the newest segment is full the next one is created and
+// the oldest files beyond max_segments are deleted.  On open() the newest
+// segment is scanned to find its end, which also rebuilds its index.
+//
+class message_journal {
+  public:
+    ~message_journal() { close(); }
+
+    bool open(const string &dir_path, size_t seg_bytes, size_t max_segs) {
+      dir = dir_path;
+      segment_bytes = max<size_t>(seg_bytes, 1 << 20);
+      max_segments = max<size_t>(max_segs, 2);
+      if ( mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST ) {
+        std::cerr << "[E] journal: cannot create " << dir << ": " << strerror(errno) << "\n";
+        return false;
+      }
+      DIR *d = opendir(dir.c_str());
+      if ( d == nullptr ) {
+        std::cerr << "[E] journal: cannot open " << dir << ": " << strerror(errno) << "\n";
+        return false;
+      }
+      vector<uint64_t> firsts;
+      while ( struct dirent *de = readdir(d) ) {
+        string name = de->d_name;
+        if ( name.size() == 24 && name.compare(20, 4, ".log") == 0 )
+          firsts.push_back(strtoull(name.c_str(), nullptr, 10));
+      }
+      closedir(d);
+      sort(firsts.begin(), firsts.end());
+
+      for ( size_t i = 0; i < firsts.size(); ++i ) {
+        segment seg;
+        seg.first_seq = firsts[i];
+        if ( !map_segment(seg, i + 1 == firsts.size()) ) {
+          close();
+          return false;
+        }
+        segments.push_back(seg);
+      }
+      if ( segments.empty() )
+        return roll(1);
+      recover(segments.back());
+      std::cerr << "[I] journal: " << segments.size() << " segments in " << dir << ", sequence "
+                << first_seq() << " to " << next_seq - 1 << "\n";
+      return true;
+    }
+
+    void close() {
+      for ( auto &seg : segments )
+        unmap_segment(seg);
+      segments.clear();
+    }
+
+    bool is_open() const { return !segments.empty(); }
+    uint64_t first_seq() const { return segments.empty() ? 0 : segments.front().first_seq; }
+    // sequence number the next append gets.
+    uint64_t end_seq() const { return next_seq; }
+
+    // whether a record for the message fits in a segment at all.
+    bool fits(size_t channel_len, size_t len) const {
+      return record_size(channel_len, len) + sizeof(record_header) <= segment_bytes;
+    }
+
+    // append one message, returns its sequence number (0 if it does not fit
+    // at all or a new segment could not be created).
+    uint64_t append(const string &channel, uint64_t channel_seq, const char *buf, size_t len) {
+      if ( segments.empty() )
+        return 0;
+      assert(channel.size() <= max_channel_name);
+      size_t rec = record_size(channel.size(), len);
+      if ( rec + sizeof(record_header) > segment_bytes )
+        return 0;
+      if ( segments.back().used + rec + sizeof(record_header) > segment_bytes ) // keep room for the end marker
+        if ( !roll(next_seq) )
+          return 0;
+      segment &seg = segments.back();
+      char *p = seg.base + seg.used;
+      record_header *h = (record_header*)p;
+      h->channel_seq = channel_seq;
+      h->len = (uint32_t)len;
+      h->channel_len = (uint16_t)channel.size();
+      h->reserved = 0;
+      memcpy(p + sizeof(record_header), channel.data(), channel.size());
+      memcpy(p + sizeof(record_header) + channel.size(), buf, len);
+      if ( seg.index_count == 0 || seg.used >= seg.index[seg.index_count - 1].offset + index_interval )
+        add_index(seg, next_seq, seg.used);
+      // seq last: a reader (or recovery after a crash) never sees half a record.
+      __atomic_store_n(&h->seq, next_seq, __ATOMIC_RELEASE);
+      seg.used += rec;
+      return next_seq++;
+    }
+
+    // call fn(seq, channel seq, channel, channel_len, payload, len) for records from sequence
+    // number from on, until about max_bytes of payload were passed or fn
+    // returns false.  Returns the sequence number to continue from.
+    template <class F> uint64_t read(uint64_t from, size_t max_bytes, F fn) {
+      from = max(from, first_seq());
+      size_t passed = 0;
+      while ( from < next_seq && passed < max_bytes ) {
+        // it: first segment starting after from, the one before it holds from.
+        auto it = upper_bound(segments.begin(), segments.end(), from,
+                              [](uint64_t s, const segment &seg) { return s < seg.first_seq; });
+        if ( it == segments.begin() )
+          break;
+        segment &seg = *( it - 1 );
+        size_t off = seek(seg, from);
+        if ( off != SIZE_MAX ) {
+          readahead(seg, off);
+          while ( off + sizeof(record_header) <= seg.size && passed < max_bytes ) {
+            const record_header *h = (const record_header*)( seg.base + off );
+            uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+            if ( seq == 0 )
+              break;
+            const char *name = seg.base + off + sizeof(record_header);
+            if ( !fn(seq, h->channel_seq, name, (size_t)h->channel_len, name + h->channel_len, (size_t)h->len) )
+              return seq;
+            passed += h->len;
+            from = seq + 1;
+            off += record_size(h->channel_len, h->len);
+          }
+        }
+        if ( passed >= max_bytes || it == segments.end() )
+          break;
+        from = max(from, it->first_seq); // rest of this segment done, on to the next.
+      }
+      return from;
+    }
+
+  private:
+    struct record_header {
+      uint64_t seq;
+      uint64_t channel_seq; // the message's sequence number within its channel
+      uint32_t len;
+      uint16_t channel_len;
+      uint16_t reserved;
+    };
+    struct index_entry {
+      uint64_t seq;
+      uint64_t offset;
+    };
+    struct segment {
+      uint64_t first_seq = 0;
+      int fd = -1;
+      int index_fd = -1;
+      char *base = nullptr;       // mapped log
+      size_t size = 0;            // mapped log length
+      size_t used = 0;            // append offset (newest segment only)
+      index_entry *index = nullptr;
+      size_t index_capacity = 0;
+      size_t index_count = 0;
+      size_t readahead_start = 0; // log range last passed to MADV_WILLNEED
+      size_t readahead_end = 0;
+    };
+    static constexpr size_t index_interval = 4096;
+    static constexpr size_t readahead_bytes = 4 * 1024 * 1024;
+
+    static size_t record_size(size_t channel_len, size_t len) {
+      return ( sizeof(record_header) + channel_len + len + 7 ) & ~(size_t)7;
+    }
+
+    string segment_path(uint64_t first, const char *ext) const {
+      char name[32];
+      snprintf(name, sizeof(name), "%020llu.%s", (unsigned long long)first, ext);
+      return dir + "/" + name;
+    }
+
+    // map a segment's log and index, creating (and sizing) the files if needed.
+    bool map_segment(segment &seg, bool writable) {
+      string log_path = segment_path(seg.first_seq, "log");
+      string idx_path = segment_path(seg.first_seq, "idx");
+      int flags = writable ? O_RDWR | O_CREAT : O_RDONLY;
+      seg.fd = ::open(log_path.c_str(), flags | O_CLOEXEC, 0644);
+      seg.index_fd = ::open(idx_path.c_str(), flags | O_CLOEXEC, 0644);
+      if ( seg.fd == -1 || seg.index_fd == -1 ) {
+        std::cerr << "[E] journal: cannot open segment " << log_path << ": " << strerror(errno) << "\n";
+        unmap_segment(seg);
+        return false;
+      }
+      struct stat st;
+      fstat(seg.fd, &st);
+      seg.size = st.st_size;
+      size_t index_size = 0;
+      if ( writable ) {
+        seg.size = max<size_t>(seg.size, segment_bytes);
+        index_size = ( seg.size / index_interval + 2 ) * sizeof(index_entry);
+        if ( ftruncate(seg.fd, seg.size) == -1 || ftruncate(seg.index_fd, index_size) == -1 ) {
+          std::cerr << "[E] journal: cannot size segment " << log_path << ": " << strerror(errno) << "\n";
+          unmap_segment(seg);
+          return false;
+        }
+      } else {
+        fstat(seg.index_fd, &st);
+        index_size = st.st_size;
+      }
+      int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+      void *base = seg.size ? mmap(nullptr, seg.size, prot, MAP_SHARED, seg.fd, 0) : MAP_FAILED;
+      void *index = index_size ? mmap(nullptr, index_size, prot, MAP_SHARED, seg.index_fd, 0) : MAP_FAILED;
+      if ( base == MAP_FAILED || index == MAP_FAILED ) {
+        std::cerr << "[E] journal: cannot map segment " << log_path << "\n";
+        if ( base != MAP_FAILED )
+          munmap(base, seg.size);
+        if ( index != MAP_FAILED )
+          munmap(index, index_size);
+        unmap_segment(seg);
+        return false;
+      }
+      seg.base = (char*)base;
+      seg.index = (index_entry*)index;
+      seg.index_capacity = index_size / sizeof(index_entry);
+      seg.index_count = 0;
+      while ( seg.index_count < seg.index_capacity && seg.index[seg.index_count].seq != 0 )
+        ++seg.index_count;
+      // appends and replays both walk the log front to back.
+      madvise(seg.base, seg.size, MADV_SEQUENTIAL);
+      return true;
+    }
+
+    void unmap_segment(segment &seg) {
+      if ( seg.base != nullptr )
+        munmap(seg.base, seg.size);
+      if ( seg.index != nullptr )
+        munmap(seg.index, seg.index_capacity * sizeof(index_entry));
+      if ( seg.fd != -1 )
+        ::close(seg.fd);
+      if ( seg.index_fd != -1 )
+        ::close(seg.index_fd);
+      seg = segment();
+    }
+
+    // find the end of the newest segment and rebuild its index.
+    void recover(segment &seg) {
+      size_t off = 0;
+      uint64_t seq = seg.first_seq;
+      seg.index_count = 0;
+      memset(seg.index, 0, seg.index_capacity * sizeof(index_entry));
+      while ( off + sizeof(record_header) <= seg.size ) {
+        const record_header *h = (const record_header*)( seg.base + off );
+        if ( h->seq != seq || off + record_size(h->channel_len, h->len) > seg.size )
+          break;
+        if ( seg.index_count == 0 || off >= seg.index[seg.index_count - 1].offset + index_interval )
+          add_index(seg, seq, off);
+        off += record_size(h->channel_len, h->len);
+        ++seq;
+      }
+      // clear whatever a crash left behind the last complete record.
+      memset(seg.base + off, 0, min(seg.size - off, sizeof(record_header)));
+      seg.used = off;
+      next_seq = seq;
+    }
+
+    void add_index(segment &seg, uint64_t seq, size_t offset) {
+      if ( seg.index_count + 1 >= seg.index_capacity )
+        return; // the scan from the previous entry still finds it.
+      seg.index[seg.index_count].offset = offset;
+      seg.index[seg.index_count].seq = seq;
+      ++seg.index_count;
+    }
+
+    // log offset of record seq in seg, SIZE_MAX if the segment does not have it.
+    size_t seek(segment &seg, uint64_t seq) {
+      if ( seg.index_count == 0 )
+        return SIZE_MAX;
+      auto *end = seg.index + seg.index_count;
+      auto *it = upper_bound(seg.index, end, seq, [](uint64_t s, const index_entry &e) { return s < e.seq; });
+      if ( it == seg.index )
+        return SIZE_MAX;
+      size_t off = ( it - 1 )->offset;
+      while ( off + sizeof(record_header) <= seg.size ) {
+        const record_header *h = (const record_header*)( seg.base + off );
+        uint64_t s = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if ( s == 0 )
+          break;
+        if ( s >= seq )
+          return off;
+        off += record_size(h->channel_len, h->len);
+      }
+      return SIZE_MAX;
+    }
+
+    // ask the kernel to read the next few MB of a segment before we get there.
+    void readahead(segment &seg, size_t off) {
+      if ( off >= seg.readahead_start && off + readahead_bytes / 2 < seg.readahead_end )
+        return;
+      size_t page = 4096;
+      size_t start = off & ~( page - 1 );
+      size_t len = min(readahead_bytes, seg.size - start);
+      madvise(seg.base + start, len, MADV_WILLNEED);
+      seg.readahead_start = start;
+      seg.readahead_end = start + len;
+    }
+
+    // start a new segment at sequence number first, drop the oldest beyond max_segments.
+    bool roll(uint64_t first) {
+      if ( !segments.empty() ) {
+        segment &last = segments.back();
+        // shrink the finished log to what was written, reopen it read only.
+        size_t used = last.used;
+        uint64_t last_first = last.first_seq;
+        unmap_segment(last);
+        string path = segment_path(last_first, "log");
+        if ( truncate(path.c_str(), used + sizeof(record_header)) == -1 )
+          std::cerr << "[W] journal: cannot shrink " << path << ": " << strerror(errno) << "\n";
+        last.first_seq = last_first;
+        if ( !map_segment(last, false) )
+          segments.pop_back();
+      }
+      segment seg;
+      seg.first_seq = first;
+      if ( !map_segment(seg, true) )
+        return false;
+      memset(seg.index, 0, seg.index_capacity * sizeof(index_entry));
+      seg.index_count = 0;
+      seg.used = 0;
+      segments.push_back(seg);
+      next_seq = first;
+      while ( segments.size() > max_segments ) {
+        uint64_t old = segments.front().first_seq;
+        unmap_segment(segments.front());
+        segments.erase(segments.begin());
+        unlink(segment_path(old, "log").c_str());
+        unlink(segment_path(old, "idx").c_str());
+      }
+      return true;
+    }
+
+    string dir;
+    size_t segment_bytes = 64 << 20;
+    size_t max_segments = 16;
+    vector<segment> segments; // oldest first, the last one takes appends.
+    uint64_t next_seq = 1;
+};
+
+////////////////////////////////////////////////////////////
+// Scratch arena
+// Memory that only lives for one round of the event loop: formatting on
+// accept, the welcome line, sequence number prefixes, compressed copies and
+// WebSocket frames built for one broadcast, replay chunks.  Allocation bumps
+// a pointer, freeing does nothing (except handing back the latest block),
+// and event_worker resets the whole arena after every epoll_wait() round.
+// A round that outgrew the first block leaves one block of the combined size
+// (up to max_kept) so the next one fits without touching malloc.
+// Debug builds (no NDEBUG) poison memory on reset and abort when a scratch
+// container from an earlier round allocates or frees, i.e. escaped the round.
+//
+class scratch_arena {
+  public:
+    static constexpr size_t first_block = 64 * 1024;
+    static constexpr size_t max_kept = 4 << 20;
+
+    void *allocate(size_t bytes) {
+      bytes = ( bytes + 15 ) & ~(size_t)15;
+      if ( bytes > (size_t)( limit - pos ) )
+        grow(bytes);
+      char *p = pos;
+      pos += bytes;
+      return p;
+    }
+
+    // only the latest allocation goes back, anything else waits for reset().
+    void deallocate(void *p, size_t bytes) {
+      bytes = ( bytes + 15 ) & ~(size_t)15;
+      if ( (char*)p + bytes == pos )
+        pos = (char*)p;
+    }
+
+    void reset() {
+#ifndef NDEBUG
+      for ( auto &b : blocks )
+        memset(b.data.get(), 0xdb, &b == &blocks.back() ? pos - b.data.get() : b.size);
+#endif
+      if ( blocks.size() > 1 ) {
+        size_t total = min(capacity(), max_kept);
+        blocks.clear();
+        grow(total);
+      }
+      pos = blocks.empty() ? nullptr : blocks.front().data.get();
+      ++round;
+    }
+
+    uint64_t generation() const { return round; }
+    size_t capacity() const {
+      size_t total = 0;
+      for ( auto &b : blocks )
+        total += b.size;
+      return total;
+    }
+
+  private:
+    struct block {
+      unique_ptr<char[]> data;
+      size_t size;
+    };
+    void grow(size_t bytes) {
+      size_t size = max(blocks.empty() ? first_block : blocks.back().size * 2, bytes);
+      blocks.push_back(block{ unique_ptr<char[]>(new char[size]), size });
+      pos = blocks.back().data.get();
+      limit = pos + size;
+    }
+
+    vector<block> blocks; // the last one takes allocations.
+    char *pos = nullptr;
+    char *limit = nullptr;
+    uint64_t round = 0;
+};
+
+// one per thread, only the worker thread resets its own.
+static thread_local scratch_arena iteration_scratch;
+
+// STL allocator on top of iteration_scratch.  Containers using it must not
+// outlive the loop round they were made in.
+template <class T> struct scratch_allocator {
+  typedef T value_type;
+#ifndef NDEBUG
+  uint64_t generation = iteration_scratch.generation();
+  void check() const {
+    if ( generation != iteration_scratch.generation() ) {
+      std::cerr << "[E] scratch memory of loop round " << generation << " used in round " << iteration_scratch.generation() << "\n";
+      abort();
+    }
+  }
+  scratch_allocator() = default;
+  template <class U> scratch_allocator(const scratch_allocator<U> &other) : generation(other.generation) {}
+#else
+  void check() const {}
+  scratch_allocator() = default;
+  template <class U> scratch_allocator(const scratch_allocator<U> &) {}
+#endif
+  T *allocate(size_t n) {
+    check();
+    return static_cast<T*>(iteration_scratch.allocate(n * sizeof(T)));
+  }
+  void deallocate(T *p, size_t n) {
+    check();
+    iteration_scratch.deallocate(p, n * sizeof(T));
+  }
+};
+template <class T, class U> bool operator==(const scratch_allocator<T> &, const scratch_allocator<U> &) { return true; }
+template <class T, class U> bool operator!=(const scratch_allocator<T> &, const scratch_allocator<U> &) { return false; }
+
+typedef basic_string<char, char_traits<char>, scratch_allocator<char>> scratch_string;
+
+////////////////////////////////////////////////////////////
+// Huge page arena
+// With --huge-pages <MB> the connection table (client_connection nodes and
+// buckets), the fan-out registry and the per-client output queues come out of
+// one region backed by 2MB pages, so the broadcast loop walks a
+// handful of TLB entries instead of one per scattered 4KB page.  The region
+// is mapped with MAP_HUGETLB when huge pages are reserved (vm.nr_hugepages),
+// otherwise as ordinary memory with MADV_HUGEPAGE for transparent huge pages.
+// Blocks come in power of two size classes with a free list each; bigger
+// requests, and everything once the region is used up, go to the heap.
+//
+class huge_arena {
+  public:
+    static constexpr size_t page_size = 2 << 20;
+    static constexpr int min_shift = 4;   // 16 byte blocks
+    static constexpr int max_shift = 20;  // 1MB blocks
+
+    huge_arena() = default;
+    huge_arena(const huge_arena &) = delete;
+    huge_arena &operator=(const huge_arena &) = delete;
+    ~huge_arena() {
+      if ( base != nullptr )
+        munmap(base, capacity);
+    }
+
+    // map bytes, rounded up to whole huge pages.  prefault touches every page
+    // now, so no page fault (or huge page compaction) lands in the event loop.
+    // huge = false keeps 4KB pages, for comparison (bench_fanout).
+    bool map(size_t bytes, bool prefault, bool huge = true) {
+      capacity = ( bytes + page_size - 1 ) / page_size * page_size;
+      int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+      void *p = huge ? mmap(nullptr, capacity, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | ( prefault ? MAP_POPULATE : 0 ), -1, 0)
+                     : MAP_FAILED;
+      if ( p != MAP_FAILED ) {
+        hugetlb = true;
+      } else {
+        // THP only backs 2MB aligned ranges, map one page extra and trim to alignment.
+        p = mmap(nullptr, capacity + page_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if ( p == MAP_FAILED ) {
+          capacity = 0;
+          return false;
+        }
+        uintptr_t start = ( (uintptr_t)p + page_size - 1 ) & ~(uintptr_t)( page_size - 1 );
+        size_t head = start - (uintptr_t)p;
+        if ( head > 0 )
+          munmap(p, head);
+        munmap((char*)start + capacity, page_size - head);
+        p = (void*)start;
+        if ( madvise(p, capacity, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE) != 0 )
+          std::cerr << "[W] madvise(MADV_HUGEPAGE) failed: " << strerror(errno) << "\n";
+        if ( prefault )
+          for ( size_t off = 0; off < capacity; off += 4096 )
+            ((volatile char*)p)[off] = 0;
+      }
+      base = (char*)p;
+      return true;
+    }
+
+    // nullptr if the request is too big or the region is used up.
+    void *allocate(size_t bytes) {
+      int shift = size_class(bytes);
+      if ( base == nullptr || shift > max_shift )
+        return nullptr;
+      free_block *&head = free_lists[shift - min_shift];
+      if ( head != nullptr ) {
+        free_block *b = head;
+        head = b->next;
+        return b;
+      }
+      size_t size = (size_t)1 << shift;
+      size_t align = min<size_t>(size, 64); // small blocks don't straddle cache lines.
+      size_t at = ( used + align - 1 ) & ~( align - 1 );
+      if ( at + size > capacity )
+        return nullptr;
+      used = at + size;
+      return base + at;
+    }
+    void deallocate(void *p, size_t bytes) {
+      free_block *b = (free_block*)p;
+      free_block *&head = free_lists[size_class(bytes) - min_shift];
+      b->next = head;
+      head = b;
+    }
+    bool owns(const void *p) const { return p >= base && p < base + capacity; }
+
+    size_t size() const { return capacity; }
+    size_t bytes_used() const { return used; } // high water mark
+    bool uses_hugetlb() const { return hugetlb; }
+    // kB of the region the kernel backs with huge pages right now.
+    size_t huge_kb() const {
+      if ( hugetlb )
+        return capacity >> 10;
+      ifstream smaps("/proc/self/smaps");
+      string line;
+      bool ours = false;
+      while ( getline(smaps, line) ) {
+        unsigned long from, to;
+        if ( sscanf(line.c_str(), "%lx-%lx ", &from, &to) == 2 && line.find(':') > line.find(' ') )
+          ours = from <= (uintptr_t)base && (uintptr_t)base < to;
+        else if ( ours && line.compare(0, 15, "AnonHugePages: ") == 0 )
+          return strtoul(line.c_str() + 15, nullptr, 10);
+      }
+      return 0;
+    }
+
+  private:
+    struct free_block {
+      free_block *next;
+    };
+    static int size_class(size_t bytes) {
+      int shift = min_shift;
+      while ( ( (size_t)1 << shift ) < bytes )
+        ++shift;
+      return shift;
+    }
+    char *base = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    bool hugetlb = false;
+    free_block *free_lists[max_shift - min_shift + 1] = {};
+};
+
+// the arena connection state is allocated from, nullptr (the default) for the heap.
+// Set up once by setup_connection_arena() before a server starts.
+static huge_arena *connection_arena = nullptr;
+
+bool setup_connection_arena(size_t bytes, bool prefault) {
+  static huge_arena arena;
+  if ( !arena.map(bytes, prefault) ) {
+    std::cerr << "[E] cannot map a " << ( bytes >> 20 ) << "MB arena: " << strerror(errno) << "\n";
+    return false;
+  }
+  connection_arena = &arena;
+  std::cerr << "[N] connection arena: " << ( arena.size() >> 20 ) << "MB, "
+            << ( arena.uses_hugetlb() ? "hugetlb pages" : "transparent huge pages" )
+            << ( prefault ? ", prefaulted (" + to_string(arena.huge_kb() >> 10) + "MB huge)" : string() ) << "\n";
+  return true;
+}
+
+// STL allocator on top of connection_arena, falls back to the heap.
+template <class T> struct arena_allocator {
+  typedef T value_type;
+  arena_allocator() = default;
+  template <class U> arena_allocator(const arena_allocator<U> &) {}
+  T *allocate(size_t n) {
+    void *p = connection_arena != nullptr ? connection_arena->allocate(n * sizeof(T)) : nullptr;
+    return static_cast<T*>( p != nullptr ? p : ::operator new(n * sizeof(T)) );
+  }
+  void deallocate(T *p, size_t n) {
+    if ( connection_arena != nullptr && connection_arena->owns(p) )
+      connection_arena->deallocate(p, n * sizeof(T));
+    else
+      ::operator delete(p);
+  }
+};
+template <class T, class U> bool operator==(const arena_allocator<T> &, const arena_allocator<U> &) { return true; }
+template <class T, class U> bool operator!=(const arena_allocator<T> &, const arena_allocator<U> &) { return false; }
+
+typedef basic_string<char, char_traits<char>, arena_allocator<char>> arena_string;
+
+////////////////////////////////////////////////////////////
+// Message compression
+// A client opts in with "compress <codec>".  From then on every message it
+// gets is an 8 byte header (compressed length, original length, both 32 bit
+// big endian) and the compressed bytes: a zstd frame (with the --zstd-dict
+// dictionary when one is loaded) or an LZ4 block.  WebSocket clients get
+// the same bytes in a binary frame.  Broadcasts are compressed once per codec
+// and the result is shared by all recipients using it.
+//
+enum compression_codec : uint8_t {
+  codec_none,
+  codec_zstd,   // builds with TCP_SERVER_WITH_ZSTD
+  codec_lz4,    // builds with TCP_SERVER_WITH_LZ4
+  codec_count
+};
+
+static const char *const codec_names[codec_count] = { "none", "zstd", "lz4" };
+
+class message_compressor {
+  public:
+    message_compressor() = default;
+    message_compressor(const message_compressor &) = delete;
+    message_compressor &operator=(const message_compressor &) = delete;
+    ~message_compressor() {
+#ifdef TCP_SERVER_WITH_ZSTD
+      ZSTD_freeCDict(zstd_cdict);
+      ZSTD_freeCCtx(zstd_cctx);
+#endif
+    }
+
+    // compression level, and the dictionary to compress with if path is not empty.
+    // A dictionary is trained offline from sample messages: zstd --train samples/* -o dict
+    bool setup_zstd(const string &path, int level) {
+#ifdef TCP_SERVER_WITH_ZSTD
+      zstd_level = level;
+      if ( path.empty() )
+        return true;
+      ifstream in(path, ios::binary);
+      if ( !in ) {
+        std::cerr << "[E] cannot read zstd dictionary " << path << "\n";
+        return false;
+      }
+      zstd_dict.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+      zstd_cdict = ZSTD_createCDict(zstd_dict.data(), zstd_dict.size(), level);
+      if ( zstd_cdict == nullptr ) {
+        std::cerr << "[E] " << path << " is not a zstd dictionary\n";
+        return false;
+      }
+      zstd_dict_id = ZSTD_getDictID_fromDict(zstd_dict.data(), zstd_dict.size());
+      std::cerr << "[N] zstd dictionary " << zstd_dict_id << " (" << zstd_dict.size() << " bytes) loaded..\n";
+      return true;
+#else
+      (void)level;
+      if ( !path.empty() )
+        std::cerr << "[E] zstd dictionary given but built without TCP_SERVER_WITH_ZSTD..\n";
+      return path.empty();
+#endif
+    }
+
+    bool available(compression_codec codec) const {
+      switch ( codec ) {
+        case codec_none: return true;
+#ifdef TCP_SERVER_WITH_ZSTD
+        case codec_zstd: return true;
+#endif
+#ifdef TCP_SERVER_WITH_LZ4
+        case codec_lz4: return true;
+#endif
+        default: return false;
+      }
+    }
+    const string &dictionary() const { return zstd_dict; }
+    uint32_t dictionary_id() const { return zstd_dict_id; } // 0 without a dictionary
+
+    // append header and compressed message to out, false if the codec failed.
+    template <class S> bool compress(compression_codec codec, const char *buf, size_t len, S &out) {
+      size_t at = out.size();
+      size_t n = 0;
+      switch ( codec ) {
+#ifdef TCP_SERVER_WITH_ZSTD
+        case codec_zstd: {
+          if ( zstd_cctx == nullptr && ( zstd_cctx = ZSTD_createCCtx() ) == nullptr )
+            return false;
+          out.resize(at + 8 + ZSTD_compressBound(len));
+          size_t r = zstd_cdict != nullptr
+            ? ZSTD_compress_usingCDict(zstd_cctx, &out[at + 8], out.size() - at - 8, buf, len, zstd_cdict)
+            : ZSTD_compressCCtx(zstd_cctx, &out[at + 8], out.size() - at - 8, buf, len, zstd_level);
+          if ( ZSTD_isError(r) ) {
+            out.resize(at);
+            return false;
+          }
+          n = r;
+          break;
+        }
+#endif
+#ifdef TCP_SERVER_WITH_LZ4
+        case codec_lz4: {
+          if ( lz4_state.empty() )
+            lz4_state.resize(( LZ4_sizeofState() + 7 ) / 8);
+          int bound = LZ4_compressBound((int)len);
+          out.resize(at + 8 + bound);
+          int r = LZ4_compress_fast_extState(lz4_state.data(), buf, &out[at + 8], (int)len, bound, 1);
+          if ( r <= 0 ) {
+            out.resize(at);
+            return false;
+          }
+          n = r;
+          break;
+        }
+#endif
+        default:
+          (void)buf; // the only use without codecs built in.
+          return false;
+      }
+      out.resize(at + 8 + n);
+      for ( int i = 0; i < 4; ++i ) {
+        out[at + i] = (char)( n >> ( 24 - i * 8 ) );
+        out[at + 4 + i] = (char)( len >> ( 24 - i * 8 ) );
+      }
+      return true;
+    }
+
+  private:
+    string zstd_dict;
+    uint32_t zstd_dict_id = 0;
+#ifdef TCP_SERVER_WITH_ZSTD
+    ZSTD_CCtx *zstd_cctx = nullptr;   // reused for every message
+    ZSTD_CDict *zstd_cdict = nullptr; // dictionary digested once, at zstd_level
+    int zstd_level = 3;
+#endif
+#ifdef TCP_SERVER_WITH_LZ4
+    vector<uint64_t> lz4_state;       // LZ4_sizeofState() bytes, 8 byte aligned
+#endif
+};
+
+////////////////////////////////////////////////////////////
+// Federation
+// Servers connected by peer links relay broadcasts to each other, so
+// clients of every node see the same channels.  A link carries frames of
+// a peer_header followed by the channel name and the message.  The header
+// goes over the wire as peer_header_bytes of little-endian fields in the
+// order below, whatever the host.  The first frame each way is a hello with
+// the sender's node id and its peer_protocol_version as the message.  Every broadcast
+// keeps the node it entered at (origin) and that node's message id, nodes
+// pass it on to their other links until peer_max_hops and drop copies they
+// have seen before, so any topology (chains, rings, full mesh) works.
+//
+enum peer_frame_type : uint8_t {
+  peer_hello   = 'H',
+  peer_message = 'M',
+  peer_subscribe   = 'S', // the sender has subscribers for the channel (--channel-owners)
+  peer_unsubscribe = 'U'  // ..and now it has none
+};
+
+struct peer_header {
+  uint32_t len;          // bytes after the header: channel name and message
+  uint16_t channel_len;  // at most max_channel_name
+  uint8_t type;          // peer_frame_type
+  uint8_t hops;          // links crossed so far
+  uint64_t origin;       // node id the message entered at (hello: the sender)
+  uint64_t id;           // origin's message id, counting from 1
+};
+
+constexpr size_t peer_header_bytes = 4 + 2 + 1 + 1 + 8 + 8;
+constexpr uint32_t peer_protocol_version = 1; // bump on any change to the frames.
+constexpr int peer_max_hops = 8;
+constexpr size_t peer_max_frame = 16 << 20; // a longer frame means the link is garbage.
+constexpr uint64_t peer_retry_ns = 1000000000; // dial a down peer at most once a second.
+
+static uint64_t random_node_id() {
+  random_device rd;
+  uint64_t id = 0;
+  while ( id == 0 )
+    id = ( (uint64_t)rd() << 32 ) | rd();
+  return id;
+}
+
+// little-endian field n bytes wide, at p.
+static void peer_put(char *p, uint64_t v, int n) {
+  for ( int i = 0; i < n; ++i )
+    p[i] = (char)( v >> ( 8 * i ) );
+}
+
+static uint64_t peer_get(const char *p, int n) {
+  uint64_t v = 0;
+  for ( int i = 0; i < n; ++i )
+    v |= (uint64_t)(uint8_t)p[i] << ( 8 * i );
+  return v;
+}
+
+static void peer_decode_header(const char *p, peer_header &h) {
+  h.len = peer_get(p, 4);
+  h.channel_len = peer_get(p + 4, 2);
+  h.type = p[6];
+  h.hops = p[7];
+  h.origin = peer_get(p + 8, 8);
+  h.id = peer_get(p + 16, 8);
+}
+
+// append one frame to out.
+static void peer_frame(string &out, peer_frame_type type, uint8_t hops, uint64_t origin, uint64_t id,
+                       const string &channel, const char *buf, size_t len) {
+  assert(channel.size() <= max_channel_name);
+  char h[peer_header_bytes];
+  peer_put(h, channel.size() + len, 4);
+  peer_put(h + 4, channel.size(), 2);
+  h[6] = (char)type;
+  h[7] = (char)hops;
+  peer_put(h + 8, origin, 8);
+  peer_put(h + 16, id, 8);
+  out.append(h, sizeof(h));
+  out += channel;
+  out.append(buf, len);
+}
+
+// remembers which message ids of each origin went by.  Ids of one origin
+// mostly arrive in order, a sliding bit window behind the highest id seen
+// catches copies that took a longer path; anything older than the window
+// counts as seen.
+class origin_filter {
+  public:
+    // true the first time (origin, id) shows up.
+    bool first_sighting(uint64_t origin, uint64_t id, uint64_t now_ns) {
+      auto it = origins.find(origin);
+      if ( it == origins.end() ) {
+        if ( origins.size() >= max_origins )
+          forget_oldest();
+        it = origins.insert(make_pair(origin, window())).first;
+      }
+      window &w = it->second;
+      w.last_ns = now_ns;
+      if ( id > w.top ) {
+        uint64_t shift = id - w.top;
+        if ( shift >= window_size )
+          w.seen.reset();
+        else
+          w.seen <<= shift;
+        w.seen.set(0);
+        w.top = id;
+        return true;
+      }
+      uint64_t age = w.top - id;
+      if ( age >= window_size || w.seen.test(age) )
+        return false;
+      w.seen.set(age);
+      return true;
+    }
+
+  private:
+    static constexpr size_t window_size = 4096;
+    static constexpr size_t max_origins = 1024; // node ids change on every start.
+    struct window {
+      uint64_t top = 0;          // highest id seen
+      bitset<window_size> seen;  // bit n: id top - n went by
+      uint64_t last_ns = 0;
+    };
+    void forget_oldest() {
+      auto oldest = origins.begin();
+      for ( auto it = origins.begin(); it != origins.end(); ++it )
+        if ( it->second.last_ns < oldest->second.last_ns )
+          oldest = it;
+      origins.erase(oldest);
+    }
+    unordered_map<uint64_t, window> origins;
+};
+
+////////////////////////////////////////////////////////////
+// Channel ownership
+// With --channel-owners every channel belongs to one node, picked by
+// consistent hashing of its name over the nodes currently linked.  Nodes
+// register their interest (local subscribers) with a channel's owner only,
+// a broadcast goes to the owner and the owner passes it to the interested
+// nodes, so nodes see only the channels their clients subscribe to.  When
+// a node comes or goes only the channels on its share of the ring move.
+//
+class hash_ring {
+  public:
+    // place every node at virtual_points spots on the ring.
+    void assign(const vector<uint64_t> &nodes) {
+      points.clear();
+      for ( auto node : nodes )
+        for ( uint64_t i = 0; i < virtual_points; ++i )
+          points.push_back(make_pair(mix(node + i * 0x9e3779b97f4a7c15ull), node));
+      sort(points.begin(), points.end());
+    }
+    // first node clockwise from the key's spot, 0 with no nodes.
+    uint64_t owner(const string &key) const {
+      if ( points.empty() )
+        return 0;
+      uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+      for ( unsigned char c : key )
+        h = ( h ^ c ) * 0x100000001b3ull;
+      auto it = lower_bound(points.begin(), points.end(), make_pair(mix(h), (uint64_t)0));
+      return it == points.end() ? points.front().second : it->second;
+    }
+
+  private:
+    static constexpr uint64_t virtual_points = 64;
+    // splitmix64 finalizer, spreads nearby inputs over the whole ring.
+    static uint64_t mix(uint64_t x) {
+      x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+      x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebull;
+      return x ^ ( x >> 31 );
+    }
+    vector<pair<uint64_t, uint64_t>> points; // (spot, node), sorted
+};
+
+////////////////////////////////////////////////////////////
+// Hot restart handoff
+// The running server passes its sockets and connection state to a newly
+// started one over an AF_UNIX SOCK_SEQPACKET socket, see TCP_Server::hand_over().
+// Every record is a type byte, its total length and as much of the payload
+// as fits one packet, with at most one fd attached (SCM_RIGHTS); the rest of
+// the payload follows in continuation packets.  Payloads are built with
+// state_writer and read back with state_reader.
+// After the end record the new server acknowledges ('A') and the old one
+// commits ('C'); only then do both act on it, so a handoff that breaks off
+// anywhere leaves every socket with the old server.
+//
+enum handoff_record : char {
+  handoff_listener = 'L', // fd, kind, unix path
+  handoff_channel  = 'H', // name, next seq, retained history
+  handoff_client   = 'C', // fd, connection state
+  handoff_end      = 'E',
+  handoff_more     = '+'  // continuation of the previous record
+};
+
+constexpr size_t handoff_packet = 32 * 1024;
+// the whole handoff, the old server's reactor is blocked meanwhile.
+constexpr uint64_t handoff_timeout_ns = 2000000000;
+
+// set the socket's send and receive timeouts to what is left until deadline_ns,
+// false once it has passed.
+static bool handoff_time_left(int sock, uint64_t deadline_ns) {
+  uint64_t now_ns = trace_clock_ns();
+  if ( now_ns >= deadline_ns )
+    return false;
+  uint64_t left_us = max<uint64_t>(( deadline_ns - now_ns ) / 1000, 1);
+  struct timeval tv = { (time_t)( left_us / 1000000 ), (suseconds_t)( left_us % 1000000 ) };
+  return setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0 &&
+         setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+struct state_writer {
+  string buf;
+  void u64(uint64_t v) { buf.append((const char*)&v, sizeof(v)); }
+  template <class S> void str(const S &s) {
+    u64(s.size());
+    buf.append(s.data(), s.size());
+  }
+};
+
+struct state_reader {
+  const string &buf;
+  size_t pos = 0;
+  bool ok = true;
+  explicit state_reader(const string &b) : buf(b) {}
+  uint64_t u64() {
+    uint64_t v = 0;
+    if ( pos + sizeof(v) > buf.size() ) {
+      ok = false;
+      return 0;
+    }
+    memcpy(&v, buf.data() + pos, sizeof(v));
+    pos += sizeof(v);
+    return v;
+  }
+  string str() {
+    uint64_t len = u64();
+    if ( !ok || pos + len > buf.size() ) {
+      ok = false;
+      return string();
+    }
+    pos += len;
+    return buf.substr(pos - len, len);
+  }
+};
+
+// one packet, with fd attached if it is not -1.
+static bool handoff_send_packet(int sock, const string &packet, int fd, uint64_t deadline_ns) {
+  if ( !handoff_time_left(sock, deadline_ns) )
+    return false;
+  struct iovec iov = { (void*)packet.data(), packet.size() };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  if ( fd != -1 ) {
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)packet.size();
+}
+
+static bool handoff_send(int sock, uint64_t deadline_ns, handoff_record type, const string &payload, int fd = -1) {
+  size_t first = min(payload.size(), handoff_packet);
+  string packet(1, type);
+  uint64_t total = payload.size();
+  packet.append((const char*)&total, sizeof(total));
+  packet.append(payload, 0, first);
+  if ( !handoff_send_packet(sock, packet, fd, deadline_ns) )
+    return false;
+  for ( size_t off = first; off < payload.size(); off += handoff_packet ) {
+    packet.assign(1, handoff_more);
+    packet.append(payload, off, handoff_packet);
+    if ( !handoff_send_packet(sock, packet, -1, deadline_ns) )
+      return false;
+  }
+  return true;
+}
+
+// one packet, fd is -1 unless one was attached.
+static ssize_t handoff_recv_packet(int sock, string &packet, int &fd) {
+  packet.resize(handoff_packet + 16);
+  struct iovec iov = { &packet[0], packet.size() };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  fd = -1;
+  if ( n <= 0 )
+    return -1;
+  packet.resize(n);
+  for ( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+    if ( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS )
+      memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return n;
+}
+
+static bool handoff_recv(int sock, handoff_record &type, string &payload, int &fd) {
+  string packet;
+  if ( handoff_recv_packet(sock, packet, fd) < (ssize_t)( 1 + sizeof(uint64_t) ) )
+    return false;
+  type = (handoff_record)packet[0];
+  uint64_t total;
+  memcpy(&total, packet.data() + 1, sizeof(total));
+  payload = packet.substr(1 + sizeof(total));
+  while ( payload.size() < total ) {
+    int more_fd;
+    if ( handoff_recv_packet(sock, packet, more_fd) < 1 || packet[0] != handoff_more )
+      return false;
+    payload.append(packet, 1, string::npos);
+  }
+  return payload.size() == total;
+}
+
+////////////////////////////////////////////////////////////
+// Newline scanning for the line framer
+// find_newline(p, n) returns the offset of the first '\n' in p[0..n), or n.
+// ("\r\n" needs no special case, the '\r' simply stays part of the line.)
+// On x86-64 the scanner compares 32 bytes per step with SSE2 (two 16 byte
+// registers) or 64 with AVX2, picked once at startup from CPUID, and the
+// scalar loop handles the tail and every other architecture.
+// bench_line_scan.cpp compares them against memchr().
+//
+typedef size_t (*newline_scanner)(const char *p, size_t n);
+
+static size_t find_newline_scalar(const char *p, size_t n) {
+  for ( size_t i = 0; i < n; ++i )
+    if ( p[i] == '\n' )
+      return i;
+  return n;
+}
+
+#if defined(__x86_64__)
+static size_t find_newline_sse2(const char *p, size_t n) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+  for ( ; i + 32 <= n; i += 32 ) {
+    __m128i a = _mm_loadu_si128((const __m128i*)( p + i ));
+    __m128i b = _mm_loadu_si128((const __m128i*)( p + i + 16 ));
+    uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(a, nl)) |
+                 (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(b, nl)) << 16;
+    if ( m != 0 )
+      return i + __builtin_ctz(m);
+  }
+  if ( i + 16 <= n ) {
+    uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)( p + i )), nl));
+    if ( m != 0 )
+      return i + __builtin_ctz(m);
+    i += 16;
+  }
+  return i + find_newline_scalar(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_newline_avx2(const char *p, size_t n) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+  for ( ; i + 64 <= n; i += 64 ) {
+    __m256i a = _mm256_loadu_si256((const __m256i*)( p + i ));
+    __m256i b = _mm256_loadu_si256((const __m256i*)( p + i + 32 ));
+    uint64_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, nl)) |
+                 (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, nl)) << 32;
+    if ( m != 0 )
+      return i + __builtin_ctzll(m);
+  }
+  if ( i + 32 <= n ) {
+    uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)( p + i )), nl));
+    if ( m != 0 )
+      return i + __builtin_ctz(m);
+    i += 32;
+  }
+  return i + find_newline_sse2(p + i, n - i);
+}
+#endif
+
+static newline_scanner pick_newline_scanner() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports("avx2") )
+    return find_newline_avx2;
+  return find_newline_sse2;
+#else
+  return find_newline_scalar;
+#endif
+}
+
+static const newline_scanner find_newline = pick_newline_scanner();
+
+////////////////////////////////////////////////////////////
+// WebSocket (RFC 6455)
+// Just enough to let browsers join the broadcast: the opening handshake
+// (SHA-1 + base64 of the client key), frame headers and payload unmasking.
+// Server frames are never masked, so one framed copy of a broadcast can be
+// written to every WebSocket recipient unchanged.
+//
+enum ws_opcode : uint8_t {
+  ws_continuation = 0x0, ws_text = 0x1, ws_binary = 0x2,
+  ws_close = 0x8, ws_ping = 0x9, ws_pong = 0xA
+};
+
+// largest message (all fragments together) we accept from a client.
+constexpr size_t ws_max_message = 1024 * 1024;
+
+// SHA-1, only used for Sec-WebSocket-Accept.
+static array<uint8_t, 20> sha1(const string &data) {
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  string msg = data;
+  uint64_t bit_len = (uint64_t)data.size() * 8;
+  msg.push_back((char)0x80);
+  while ( msg.size() % 64 != 56 )
+    msg.push_back('\0');
+  for ( int i = 7; i >= 0; --i )
+    msg.push_back((char)(bit_len >> (i * 8)));
+
+  auto rol = [](uint32_t v, int s) { return ( v << s ) | ( v >> (32 - s) ); };
+  for ( size_t off = 0; off < msg.size(); off += 64 ) {
+    uint32_t w[80];
+    for ( int i = 0; i < 16; ++i ) {
+      const uint8_t *p = (const uint8_t*)msg.data() + off + i * 4;
+      w[i] = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+    for ( int i = 16; i < 80; ++i )
+      w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for ( int i = 0; i < 80; ++i ) {
+      uint32_t f, k;
+      if ( i < 20 )      { f = ( b & c ) | ( ~b & d );           k = 0x5A827999; }
+      else if ( i < 40 ) { f = b ^ c ^ d;                        k = 0x6ED9EBA1; }
+      else if ( i < 60 ) { f = ( b & c ) | ( b & d ) | ( c & d ); k = 0x8F1BBCDC; }
+      else               { f = b ^ c ^ d;                        k = 0xCA62C1D6; }
+      uint32_t t = rol(a, 5) + f + e + k + w[i];
+      e = d; d = c; c = rol(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+  }
+  array<uint8_t, 20> out;
+  for ( int i = 0; i < 20; ++i )
+    out[i] = (uint8_t)(h[i / 4] >> (24 - (i % 4) * 8));
+  return out;
+}
+
+static string base64_encode(const uint8_t *data, size_t len) {
+  static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  string out;
+  for ( size_t i = 0; i < len; i += 3 ) {
+    uint32_t v = (uint32_t)data[i] << 16;
+    if ( i + 1 < len ) v |= (uint32_t)data[i+1] << 8;
+    if ( i + 2 < len ) v |= data[i+2];
+    out.push_back(table[( v >> 18 ) & 63]);
+    out.push_back(table[( v >> 12 ) & 63]);
+    out.push_back(i + 1 < len ? table[( v >> 6 ) & 63] : '=');
+    out.push_back(i + 2 < len ? table[v & 63] : '=');
+  }
+  return out;
+}
+
+// Sec-WebSocket-Accept value for a client's Sec-WebSocket-Key.
+static string ws_accept_key(const string &key) {
+  auto digest = sha1(key + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+  return base64_encode(digest.data(), digest.size());
+}
+
+// XOR payload with the 4 byte client mask.  offset is the payload position
+// of buf[0], so a payload can be unmasked in pieces.  16 bytes per step with
+// SSE2 (always there on x86-64), byte at a time for the tail and elsewhere.
+static void ws_unmask(uint8_t *buf, size_t len, const uint8_t mask[4], size_t offset = 0) {
+  size_t i = 0;
+#if defined(__x86_64__)
+  if ( len >= 16 ) {
+    uint32_t m;
+    uint8_t rotated[4];
+    for ( int k = 0; k < 4; ++k )
+      rotated[k] = mask[( offset + k ) & 3];
+    memcpy(&m, rotated, 4);
+    const __m128i vmask = _mm_set1_epi32((int)m);
+    for ( ; i + 16 <= len; i += 16 ) {
+      __m128i v = _mm_loadu_si128((const __m128i*)( buf + i ));
+      _mm_storeu_si128((__m128i*)( buf + i ), _mm_xor_si128(v, vmask));
+    }
+  }
+#endif
+  for ( ; i < len; ++i )
+    buf[i] ^= mask[( offset + i ) & 3];
+}
+
+// frame header for a server to client frame (FIN set, no mask).
+static size_t ws_frame_header(uint8_t out[10], uint8_t opcode, size_t len) {
+  out[0] = 0x80 | opcode;
+  if ( len < 126 ) {
+    out[1] = (uint8_t)len;
+    return 2;
+  }
+  if ( len <= 0xFFFF ) {
+    out[1] = 126;
+    out[2] = (uint8_t)( len >> 8 );
+    out[3] = (uint8_t)len;
+    return 4;
+  }
+  out[1] = 127;
+  for ( int i = 0; i < 8; ++i )
+    out[2 + i] = (uint8_t)( (uint64_t)len >> ( 56 - i * 8 ) );
+  return 10;
+}
+
+// whole frame: header plus payload.  Plain ASCII goes out as a text frame,
+// anything else as binary (browsers drop the connection on invalid UTF-8 text).
+static scratch_string ws_frame(const char *buf, size_t len, bool binary = false) {
+  uint8_t opcode = binary ? ws_binary : ws_text;
+  for ( size_t i = 0; i < len && !binary; ++i )
+    if ( (uint8_t)buf[i] & 0x80 ) {
+      opcode = ws_binary;
+      break;
+    }
+  uint8_t header[10];
+  size_t hlen = ws_frame_header(header, opcode, len);
+  scratch_string frame;
+  frame.reserve(hlen + len);
+  frame.append((const char*)header, hlen);
+  frame.append(buf, len);
+  return frame;
+}
+
+// parsed client frame header.
+struct ws_frame_info {
+  bool fin;
+  uint8_t opcode;
+  bool masked;
+  uint8_t mask[4];
+  size_t header_len;
+  uint64_t payload_len;
+};
+
+// parse the frame header at buf, false until len covers all of it.
+static bool ws_parse_header(const uint8_t *buf, size_t len, ws_frame_info &f) {
+  if ( len < 2 )
+    return false;
+  f.fin = buf[0] & 0x80;
+  f.opcode = buf[0] & 0x0F;
+  f.masked = buf[1] & 0x80;
+  f.payload_len = buf[1] & 0x7F;
+  size_t pos = 2;
+  if ( f.payload_len == 126 ) {
+    if ( len < 4 )
+      return false;
+    f.payload_len = (uint64_t)buf[2] << 8 | buf[3];
+    pos = 4;
+  } else if ( f.payload_len == 127 ) {
+    if ( len < 10 )
+      return false;
+    f.payload_len = 0;
+    for ( int i = 0; i < 8; ++i )
+      f.payload_len = f.payload_len << 8 | buf[2 + i];
+    pos = 10;
+  }
+  if ( f.masked ) {
+    if ( len < pos + 4 )
+      return false;
+    memcpy(f.mask, buf + pos, 4);
+    pos += 4;
+  }
+  f.header_len = pos;
+  return true;
+}
+
+////////////////////////////////////////////////////////////
+// Server configuration
+// Everything TCP_Server needs to know before it binds.
+//
+struct server_config {
+  // hosts/addresses to listen on, each resolved with getaddrinfo().
+  // Every resolved address gets its own listener, all served by the same epoll loop.
+  // Empty list means dual-stack any address ("::", falls back to 0.0.0.0 without IPv6).
+  vector<string> bind_addresses;
+  uint16_t port = 9090;
+  bool ipv6_only = false;         // do not accept IPv4-mapped clients on "::" listeners.
+  int resolve_timeout_ms = 5000;  // give up on name resolution after this long.
+  bool listen_tcp = true;         // false to serve only the unix socket below.
+  string unix_path;               // if set, also listen on this AF_UNIX stream socket.
+  int unix_mode = -1;             // chmod() applied to unix_path, -1 keeps the umask result.
+  uint16_t admin_port = 0;        // HTTP admin port (/metrics, /healthz, /latency), 0 disables.
+  bool latency_trace = true;      // time epoll batches and accept/read/fan-out phases.
+  bool verbose = false;           // log every message and its recipients.
+  int epoll_batch_max = 1024;     // ceiling for the adaptive epoll_wait() event array.
+  size_t read_budget_bytes = 64 * 1024; // per connection per loop iteration, then others get a turn.
+  int read_budget_messages = 64;        // same, counted in messages.
+  // admission control at accept time, 0 disables a limit.
+  int max_connections = 0;              // total connected clients.
+  int max_connections_per_ip = 0;       // concurrent connections from one source address.
+  double connect_rate_per_ip = 0;       // new connections per second per source address (token bucket rate)
+  double connect_burst_per_ip = 10;     // token bucket depth
+  // inbound rate limits, 0 disables.  Over the limit a client simply is not read
+  // (EPOLLIN interest removed) until its bucket refills, TCP flow control does the rest.
+  double client_rate_messages = 0;      // messages per second per connection
+  double client_rate_bytes = 0;         // bytes per second per connection
+  double channel_rate_messages = 0;     // messages per second per channel, all publishers together
+  double channel_rate_bytes = 0;        // bytes per second per channel
+  // TLS listener on the same addresses, needs a build with TCP_SERVER_WITH_TLS.
+  uint16_t tls_port = 0;                // 0 disables.
+  string tls_cert_file;                 // PEM certificate (chain)
+  string tls_key_file;                  // PEM private key
+  bool tls_ktls = true;                 // hand sessions to kernel TLS after the handshake if possible.
+  size_t tls_max_pending = 1024 * 1024; // encrypted output buffered per client before messages are dropped.
+  bool tls_batch_fanout = true;         // encrypt each userspace TLS client's messages once per loop iteration.
+  // WebSocket clients on the same listeners.  New connections are sniffed:
+  // an HTTP "GET" starts the upgrade handshake, anything else (or silence for
+  // websocket_sniff_ms) makes it a raw client, which then gets its welcome.
+  bool websocket = false;
+  int websocket_sniff_ms = 250;
+  // raw clients send newline terminated messages, a read may carry several
+  // of them or part of one.  false treats every read() as one message.
+  bool line_framing = true;
+  size_t max_line_bytes = 64 * 1024;   // a longer line is passed on in pieces of this size.
+  // outbound coalescing: messages for a client are queued and written with one
+  // write() once the batch is done.  coalesce_us > 0 holds output until that
+  // long after the first queued message, spanning several epoll batches.
+  bool coalesce = false;
+  int coalesce_us = 0;
+  size_t out_max_pending = 1024 * 1024; // per client queue before messages are dropped.
+  // per channel history replayed to new subscribers (on connect and on join).
+  size_t history_messages = 0;          // messages kept per channel, 0 disables.
+  size_t history_bytes = 256 * 1024;    // message bytes kept per channel (history and seq retention).
+  int history_seconds = 0;              // also forget messages older than this, 0 keeps them.
+  // prefix every broadcast with "[<channel>#<seq>] ", seq counting per channel.
+  // A client back from a short disconnect sends "since <channel> <seq>" and gets
+  // what it missed from the last seq_retention messages kept in memory.
+  bool sequence_numbers = false;
+  size_t seq_retention = 4096;
+  // journal every broadcast to mmap()ed segment files, clients catch up with
+  // "replay <seq>".  Empty journal_dir disables it.
+  string journal_dir;
+  size_t journal_segment_bytes = 64 << 20;
+  size_t journal_max_segments = 16;     // oldest segment files are deleted beyond this.
+  // hot restart: a server started with the same upgrade_socket path takes the
+  // listeners and connections over from the one running there, which then exits.
+  string upgrade_socket;
+  // federation: peer links relay broadcasts between servers, see peer_link.
+  uint16_t peer_port = 0;               // listen for peers on the TCP addresses, 0 disables.
+  vector<string> peers;                 // host:port of peers to dial (and redial).
+  size_t peer_max_pending = 4 << 20;    // per link queue before messages are dropped.
+  // route broadcasts through each channel's owner node to the nodes with
+  // subscribers instead of flooding every link.  Needs a full mesh of links.
+  bool channel_owners = false;
+  // compression clients can ask for with "compress <codec>", see message_compressor.
+  string zstd_dict_file;                // trained zstd dictionary, none if empty.
+  int zstd_level = 3;
+  socket_profile profile;         // socket options for listeners and clients.
+};
+
+////////////////////////////////////////////////////////////
+// Per connection state
+// One of these lives in TCP_Server::clients for every accepted socket.
+//
+struct client_connection {
+  int fd = -1;
+  int family = AF_UNSPEC;   // AF_INET, AF_INET6 or AF_UNIX
+  string peer;              // printable peer address, for logging.
+  bool has_cred = false;    // true when cred is valid (AF_UNIX peers only).
+  struct ucred cred;        // peer pid/uid/gid as verified by the kernel at connect time.
+  bool in_ready_list = false; // read budget ran out with data left, queued in TCP_Server::ready_list.
+  bool ip_tracked = false;    // counted in TCP_Server::admission under ip_key.
+  admission_table::key_type ip_key;
+  int channel = 0;            // channel this client publishes to.
+  uint64_t channel_mask = 1;  // channels this client receives, bit per channel id.
+  token_bucket message_rate;  // inbound limits for this connection.
+  token_bucket byte_rate;
+  uint64_t throttled_until_ns = 0; // non zero while EPOLLIN is switched off for rate limiting.
+  uint32_t epoll_events = 0;  // interest currently registered with epoll.
+  bool sniffing = false;      // waiting for the first bytes to tell raw from WebSocket.
+  uint64_t sniff_deadline_ns = 0; // treated as raw if still sniffing by then.
+  bool websocket = false;     // upgraded, messages travel in WebSocket frames.
+  string ws_in;               // handshake request or partial frames read so far.
+  string ws_message;          // fragments of a message still waiting for its FIN frame.
+  bool ws_fragmented = false; // a fragmented message is in progress.
+  string line_in;             // start of a line still waiting for its '\n'.
+  arena_string out;           // coalesced output not written yet.
+  bool in_flush_list = false; // queued in TCP_Server::flush_list.
+  bool out_blocked = false;   // the socket took only part of out, waiting for EPOLLOUT.
+  bool replaying = false;     // streaming the journal, live broadcasts are held back meanwhile.
+  uint64_t replay_seq = 0;    // next journal sequence number to send.
+  compression_codec codec = codec_none; // negotiated with "compress <codec>".
+#ifdef TCP_SERVER_WITH_TLS
+  SSL *ssl = nullptr;         // set for clients of the TLS listener.
+  bool tls_handshaking = false;
+  bool tls_want_write = false; // OpenSSL is waiting for the socket to become writable.
+  bool tls_write_wants_read = false; // SSL_write() needs the peer's data first, EPOLLIN retries it.
+  bool ktls_send = false;     // kernel encrypts, plain write() works.
+  bool ktls_recv = false;     // kernel decrypts, SSL_read() is a plain recvmsg().
+  arena_string tls_out;       // plaintext waiting for SSL_write(): this iteration's batch and/or a retry.
+  bool in_tls_batch = false;  // queued in TCP_Server::tls_batch for the end of iteration flush.
+#endif
+};
+
+////////////////////////////////////////////////////////////
+// Peer link state, see Federation above.
+struct peer_link {
+  int fd = -1;
+  string name;                // host:port we dialed, or the peer's address.
+  int target = -1;            // index in TCP_Server::peer_targets for links we dialed.
+  bool connecting = false;    // nonblocking connect() still in progress.
+  uint64_t node = 0;          // peer's node id, 0 until its hello arrived.
+  string in;                  // partial frames read so far.
+  string out;                 // frames queued for the end of the loop iteration.
+  bool out_blocked = false;   // the socket took only part of out, waiting for EPOLLOUT.
+  uint32_t epoll_events = 0;
+};
+
+// a peer we keep a link to, redialed when the link drops.
+struct peer_target {
+  string address;             // host:port as configured
+  struct sockaddr_storage addr;
+  socklen_t addr_len = 0;     // 0 if it did not resolve
+  int fd = -1;                // current link, -1 while down
+  uint64_t retry_ns = 0;      // next dial attempt
+};
+
+////////////////////////////////////////////////////////////
+// Fan-out registry
+// Clients taking part in broadcasts.  deliver_message() tests every one of
+// them for every message, so the fields it tests live in parallel arrays
+// (structure of arrays) instead of in client_connection: 50k recipients are
+// ~850KB of fds, masks, queue sizes and flags, which stays in L2, and only
+// the clients that actually get the message have their connection touched.
+// Removal swaps the last entry into the hole, fan-out order is not kept.
+// Whoever changes a mirrored client_connection field calls refresh().
+//
+class fanout_registry {
+  public:
+    enum {
+      replaying = 1, // client.replaying, held back from live broadcasts.
+      framed = 2,    // codec, WebSocket or TLS: the bytes queued are not the message as is.
+    };
+
+    size_t size() const { return fds.size(); }
+    bool contains(int fd) const { return fd >= 0 && (size_t)fd < slots.size() && slots[fd] >= 0; }
+    int fd(size_t i) const { return fds[i]; }
+    uint64_t mask(size_t i) const { return masks[i]; }
+    uint8_t flag(size_t i) const { return flags[i]; }
+    uint32_t pending(size_t i) const { return pending_bytes[i]; }
+    client_connection &connection(size_t i) const { return *conns[i]; }
+
+    // conn must stay put while registered (unordered_map nodes do).
+    void add(client_connection &conn) {
+      if ( (size_t)conn.fd >= slots.size() )
+        slots.resize(conn.fd + 1, -1);
+      slots[conn.fd] = (int)fds.size();
+      fds.push_back(conn.fd);
+      masks.push_back(0);
+      flags.push_back(0);
+      pending_bytes.push_back(0);
+      conns.push_back(&conn);
+      refresh(conn);
+    }
+
+    void remove(int fd) {
+      if ( !contains(fd) )
+        return;
+      size_t i = slots[fd];
+      size_t last = fds.size() - 1;
+      if ( i != last ) {
+        fds[i] = fds[last];
+        masks[i] = masks[last];
+        flags[i] = flags[last];
+        pending_bytes[i] = pending_bytes[last];
+        conns[i] = conns[last];
+        slots[fds[i]] = (int)i;
+      }
+      fds.pop_back();
+      masks.pop_back();
+      flags.pop_back();
+      pending_bytes.pop_back();
+      conns.pop_back();
+      slots[fd] = -1;
+    }
+
+    void clear() {
+      fds.clear();
+      masks.clear();
+      flags.clear();
+      pending_bytes.clear();
+      conns.clear();
+      slots.clear();
+    }
+
+    // copy the hot fields of a registered client again.
+    void refresh(const client_connection &conn) {
+      if ( !contains(conn.fd) )
+        return;
+      size_t i = slots[conn.fd];
+      masks[i] = conn.channel_mask;
+      pending_bytes[i] = (uint32_t)min<size_t>(conn.out.size(), UINT32_MAX);
+      bool is_framed = conn.websocket || conn.codec != codec_none;
+#ifdef TCP_SERVER_WITH_TLS
+      is_framed = is_framed || ( conn.ssl != nullptr && !conn.ktls_send );
+#endif
+      flags[i] = ( conn.replaying ? replaying : 0 ) | ( is_framed ? framed : 0 );
+    }
+
+    // queue size only, cheaper than refresh() on every queued message.
+    void set_pending(int fd, size_t bytes) {
+      if ( contains(fd) )
+        pending_bytes[slots[fd]] = (uint32_t)min<size_t>(bytes, UINT32_MAX);
+    }
+
+  private:
+    // hot, read for every recipient.
+    vector<int, arena_allocator<int>> fds;
+    vector<uint64_t, arena_allocator<uint64_t>> masks;
+    vector<uint8_t, arena_allocator<uint8_t>> flags;
+    vector<uint32_t, arena_allocator<uint32_t>> pending_bytes; // bytes in client.out
+    // cold, read for the clients that get the message.
+    vector<client_connection*, arena_allocator<client_connection*>> conns;
+    vector<int> slots; // fd to index, -1 if not registered.
+};
+
+////////////////////////////////////////////////////////////
+// TCP Server class
+// Use this class and extend it for your application..
+//
+class TCP_Server {
+  public:
+    //* constructor taking a full server configuration.
+    TCP_Server(const server_config &config);
+    //* constructor to define bind interface and port
+    TCP_Server(string localHost, uint16_t localPort, const socket_profile &profile = socket_profile());
+    //* constructor to define just local port, listens dual-stack on all interfaces.
+    TCP_Server(uint16_t localPort, const socket_profile &profile = socket_profile());
+    //* destructor
+    ~TCP_Server();
+    // tell if TCP server is running
+    bool isAlive() { return isRunning; }
+    // current totals of all runtime metrics, safe to call from any thread.
+    metrics_snapshot get_metrics() const { return metrics.snapshot(); }
+    // text dump of the event loop latency histograms, safe to call from any thread.
+    string latency_report() const;
+  private:
+    // sockets used by listeners to accept connections. (one per bound address)
+    vector<int> listener_fds;
+    // resolve all bind addresses, create a socket per address and bind it. (doesn't listen() ..)
+    int create_and_bind(const vector<string> &localHosts, const uint16_t &localPort);
+    // resolve hostnames to passive addresses without blocking past resolve_timeout_ms.
+    bool resolve_bind_addresses(const vector<string> &localHosts, const uint16_t &localPort,
+                                vector<struct sockaddr_storage> &addresses);
+    // create one listener socket bound to address.
+    int bind_listener(const struct sockaddr_storage &address, bool v6only);
+    // create the AF_UNIX listener socket bound to path.
+    int bind_unix_listener(const string &path);
+    // tell if fd is one of our listener sockets.
+    bool is_listener(int fd);
+    // close all listener sockets.
+    void close_listeners();
+    // hot restart: take sockets and state over from the server on path, false if there is none.
+    bool take_over(const string &path);
+    // hot restart: restore one handed over connection.
+    bool restore_client(int fd, const string &state);
+    // hot restart: AF_UNIX SOCK_SEQPACKET listener the next server connects to.
+    int bind_upgrade_listener(const string &path);
+    // hot restart: pass every socket and connection to the new server on sock, true once it took them.
+    bool hand_over(int sock);
+    // open the broadcast journal if configured.
+    bool open_journal();
+    // load the zstd dictionary (and level) the codecs compress with.
+    bool setup_compression();
+    // "compress <codec>" and "dict".
+    bool handle_compress_command(int fd, const char *buf, size_t len);
+    // append one message the way conn takes it: compressed, in a WebSocket frame, or as is.
+    void append_wire(scratch_string &out, const client_connection &conn, const char *buf, size_t len);
+    // header and compressed message, false (and logged) if the codec failed.
+    bool pack_message(compression_codec codec, const char *buf, size_t len, scratch_string &packed);
+    // make a socket not blocking.
+    bool make_socket_nonblocking( int socketfd);
+    // set one integer socket option, warn on failure.
+    bool set_socket_option(int fd, int level, int option, int value, const char *name);
+    // apply socket profile to the listener socket. (before listen())
+    void apply_listener_profile(int fd);
+    // apply socket profile to an accepted client socket.
+    void apply_client_profile(int fd);
+    // accept a new connection, add it to list of clients.
+    int accept_connection(int socketfd, struct epoll_event& event, int epollfd);
+    // check connection limits for a new client, track it if admitted.
+    bool admit_connection(const struct sockaddr_storage &addr, client_connection &conn);
+    // remove a client from the client list and close its socket.
+    void close_client(int fd);
+    // write a message to one client, framed for WebSocket clients.
+    ssize_t send_to_client(int fd, const void *buf, size_t len);
+    // write bytes as they go on the wire, counting bytes out and drops.
+    ssize_t write_to_client(int fd, const void *buf, size_t len);
+    // append to the client's coalescing queue instead of writing now.
+    ssize_t queue_output(client_connection &conn, const void *buf, size_t len);
+    // write() as much of the client's queued output as the socket takes.
+    void flush_output(int fd);
+    // flush every client with queued output, at the end of the batch or coalescing window.
+    void flush_coalesced();
+    // send a message from one client to every other client.
+    void broadcast_message(int from_fd, const char *buf, size_t len);
+    // write a message to the local subscribers of channel, except from_fd (-1 for none).
+    void deliver_message(int channel, int from_fd, const char *buf, size_t len);
+    // federation, see the Peer links section.
+    void resolve_peers();
+    void dial_peers(uint64_t now_ns);
+    void accept_peer(int socketfd);
+    void peer_connected(int fd);
+    void update_peer_interest(int fd);
+    void close_peer(int fd);
+    void peer_event(int fd, uint32_t events);
+    void read_peer(int fd);
+    bool peer_frame_received(int fd, const peer_header &h, const char *body);
+    void relay_to_peers(const string &channel, uint8_t hops, uint64_t origin, uint64_t id,
+                        const char *buf, size_t len, int from_fd);
+    // pass a broadcast on, flooding or through the channel's owner.
+    void forward_message(int channel, uint8_t hops, uint64_t origin, uint64_t id,
+                         const char *buf, size_t len, int from_fd);
+    bool queue_to_peer(int fd, const string &frame);
+    int peer_fd(uint64_t node);
+    // channel ownership, see hash_ring.
+    void rebuild_ring();
+    void update_interest(int channel);
+    void subscriptions_changed(uint64_t old_mask, uint64_t new_mask);
+    void flush_peers();
+    void flush_peer(int fd);
+    // result of servicing one readable client.
+    enum read_status { read_drained, read_more, read_closed, read_throttled };
+    // read from a client up to its fairness budget, handle what was read.
+    read_status read_client(int fd, bool tracing);
+    // queue a client with unread data for another slice later in this iteration.
+    void push_ready(int fd);
+    // handle one message from a client: quit, channel commands, else broadcast.
+    // false if the client was closed.  Time spent in fan-out is added to fanout_ns.
+    bool handle_message(int fd, const char *buf, size_t len, bool tracing, uint64_t &fanout_ns);
+    // split raw client input into lines and handle each, false if the client was closed.
+    bool frame_lines(int fd, const char *buf, size_t len, bool tracing, uint64_t &fanout_ns);
+    // bytes from a client that is being sniffed or speaks WebSocket, false if it was closed.
+    bool ws_input(int fd, const char *buf, size_t len, bool tracing, uint64_t &fanout_ns);
+    // answer the HTTP upgrade request in the client's ws_in, false if it was refused and closed.
+    bool ws_handshake(int fd, size_t request_len);
+    // send a close frame with status code and close the client.
+    void ws_fail(int fd, uint16_t code);
+    // handle a "join <channel>" / "leave <channel>" request, false if buf is not one.
+    bool handle_channel_command(int fd, const char *buf, size_t len);
+    // look up a channel by name, creating it if needed.  -1 when the table is full
+    // or the name is longer than max_channel_name.
+    int channel_id(const string &name);
+    // send a channel's recent messages to a client that just subscribed.
+    void replay_history(int fd, int channel);
+    // handle a "since <channel> <seq>" request, false if buf is not one.
+    bool handle_since_command(int fd, const char *buf, size_t len);
+    // append one message as this client gets it: sequence prefix, WebSocket frame.
+    void append_message(scratch_string &out, const client_connection &conn, const string &channel,
+                        uint64_t seq, const char *buf, size_t len);
+    // handle a "replay <seq>" request, false if buf is not one.
+    bool handle_replay_command(int fd, const char *buf, size_t len);
+    // queue the next slice of journal records for a replaying client.
+    void continue_replay(int fd);
+    // queue bulk output (history, journal) behind anything pending, for plain and TLS clients.
+    void queue_to_client(client_connection &conn, const char *buf, size_t len);
+    // stop reading a client that is over its inbound rate, false if it is within limits.
+    bool throttle_client(int fd, uint64_t now_ns);
+    // resume reading clients whose rate limit wait is over.
+    void unthrottle_clients(uint64_t now_ns);
+    // epoll_wait() timeout that wakes us for the next unthrottle.
+    int next_timeout_ms(int idle_ms);
+    // register the epoll interest matching the client's state (throttled, output pending).
+    void update_epoll_interest(int fd);
+    // new client (after accept or the TLS handshake): sniff for WebSocket or go to client_ready().
+    void client_accepted(int fd);
+    // clients that stayed silent through the sniff window are raw clients.
+    void expire_sniffing(uint64_t now_ns);
+    // add a client to the broadcast list and send the welcome message.
+    void client_ready(int fd);
+    // read() for plain clients, SSL_read() for TLS clients.
+    ssize_t client_read(client_connection &conn, char *buf, size_t len);
+    // the socket became writable.
+    void client_writable(int fd);
+#ifdef TCP_SERVER_WITH_TLS
+    // create the TLS context from the configured certificate and key.
+    bool setup_tls();
+    // continue a non-blocking TLS handshake.
+    read_status tls_handshake(int fd);
+    // SSL_write() for clients without kernel TLS send.
+    ssize_t tls_send(client_connection &conn, const void *buf, size_t len);
+    // retry output OpenSSL could not write earlier.
+    void flush_tls_output(int fd);
+    // encrypt and send every batched userspace TLS client, once per loop iteration.
+    void flush_tls_batch();
+    SSL_CTX *tls_ctx = nullptr;
+    vector<int> tls_batch; // userspace TLS clients with plaintext batched this iteration.
+#endif
+    vector<int> tls_listener_fds; // TLS listeners, also part of listener_fds.
+    // accept a connection on the admin port.
+    void accept_admin_connection(int socketfd, int epollfd);
+    // read from an admin connection, answer once the request is complete.
+    void handle_admin_request(int fd);
+    // close an admin connection.
+    void close_admin(int fd);
+
+    /////////////////////////////////////////////////////////////////////
+    // overload this function to handle events for your appplication..
+    // implements a simple echo server. Received messages are sent to all connected clients.
+    void event_worker();
+
+    // internal methods to start/stop event_worker thread.
+    void start_event_worker();
+    void stop_event_worker();
+    // member datastructures
+    atomic<bool> worker_state; // 0 -- offline, 1 -- online, set by worker thread.
+    atomic<bool> isRunning; // when true, tells worker to keep running. False signals worker to stop.
+    thread epoll_worker; // worker thread running event_worker() method.
+    struct epoll_event event; // epoll event structure for configurating epoll
+    vector<struct epoll_event> events; // list of events to handle from epoll_wait() call, sized by the worker.
+    deque<int> ready_list; // clients that hit their read budget with data left, served round-robin.
+    admission_table admission; // per source address connection counts and connect rate buckets.
+    int epollfd = -1; // the worker's epoll set.
+    vector<channel_state> channels; // broadcast channels, index is the channel id.
+    unordered_map<string, int> channel_ids; // channel name to id.
+    priority_queue<pair<uint64_t, int>, vector<pair<uint64_t, int>>, greater<pair<uint64_t, int>>> throttled; // (resume time, fd)
+    deque<pair<uint64_t, int>> sniffing; // (deadline, fd) of clients not yet known to be raw or WebSocket, oldest first.
+    vector<int> flush_list; // clients with coalesced output queued.
+    uint64_t flush_deadline_ns = 0; // when flush_list is due.
+    message_journal journal; // broadcast journal, open when config.journal_dir is set.
+    message_compressor compressor; // codecs for clients that asked for compression.
+    int upgrade_listener_fd = -1; // hot restart listener, see hand_over().
+    bool handed_over = false; // sockets belong to the new server now, leave paths alone on shutdown.
+    fanout_registry fanout; // connected clients taking part in broadcasts.
+    unordered_map<int, client_connection, hash<int>, equal_to<int>,
+                  arena_allocator<pair<const int, client_connection>>> clients; // per connection state, keyed by fd.
+    string unix_listener_path; // path we bound, unlinked on shutdown.
+    metrics_registry metrics; // runtime counters, one slot per reactor thread.
+    metrics_slot *stats = nullptr; // this worker's slot, only touched by the worker thread.
+    loop_trace trace; // event loop latency histograms, written by the worker thread only.
+    vector<int> admin_listener_fds; // admin port listeners (HTTP /metrics, /healthz, /latency)
+    vector<int> peer_listener_fds; // federation listeners on config.peer_port.
+    unordered_map<int, peer_link> peer_links; // established and dialing peer links, keyed by fd.
+    vector<peer_target> peer_targets; // peers from config.peers.
+    uint64_t next_dial_ns = 0; // when a down peer is due for a dial.
+    bool peers_pending = false; // some link has frames queued.
+    uint64_t node_id = random_node_id(); // names this server on peer links, new on every start.
+    uint64_t next_message_id = 1; // id of the next broadcast starting here.
+    uint64_t messages_handled = 0; // handle_message() calls, read_client() charges them to read_budget_messages.
+    origin_filter seen_messages; // peer messages already delivered.
+    hash_ring ring; // channel owners among this node and its linked peers.
+    unordered_map<int, string> admin_conns; // admin connections and their partial request.
+    server_config config; // bind addresses, socket profile and other options.
+};
+
+///////////////////////////////////////////////////////
+// Constructor taking a full configuration
+TCP_Server::TCP_Server(const server_config &config)
+  : isRunning(false), config(config) {
+  // a server already running on the upgrade socket hands its sockets over,
+  // otherwise this is a fresh start.
+  bool took_over = !config.upgrade_socket.empty() && take_over(config.upgrade_socket);
+  if ( took_over || create_and_bind( config.bind_addresses, config.port) == 0 ) {
+    if ( !config.upgrade_socket.empty() )
+      upgrade_listener_fd = bind_upgrade_listener(config.upgrade_socket);
+    // bound successfully, start event handling thread.
+    start_event_worker();
+  }
+}
+
+///////////////////////////////////////////////////////
+// Constructor specifing bind host and port
+TCP_Server::TCP_Server(string localHost, uint16_t localPort, const socket_profile &profile)
+  : isRunning(false) {
+  config.bind_addresses.push_back(localHost);
+  config.port = localPort;
+  config.profile = profile;
+  if ( create_and_bind( config.bind_addresses, localPort) == 0 ) {
+    // bound successfully, start event handling thread.
+    start_event_worker();
+  }
+}
+
+//////////////////////////////////////////////////////
+// Constructor specifing port only, dual-stack any address is assumed.
+TCP_Server::TCP_Server(uint16_t localPort, const socket_profile &profile)
+  : isRunning(false) {
+  config.port = localPort;
+  config.profile = profile;
+  if ( create_and_bind( config.bind_addresses, localPort) == 0 ) {
+    // bound successfully, start event handling thread.
+    start_event_worker();
+  }
+}
+
+//////////////////////////////////////////////////////
+// Destructor to shutdown service threads..
+TCP_Server::~TCP_Server() {
+  //signal shutdown of event_worker thread.  Wait for it finish.
+  if ( epoll_worker.joinable() )
+    stop_event_worker();
+#ifdef TCP_SERVER_WITH_TLS
+  for ( auto &c : clients )
+    if ( c.second.ssl != nullptr )
+      SSL_free(c.second.ssl);
+  if ( tls_ctx != nullptr )
+    SSL_CTX_free(tls_ctx);
+#endif
+}
+
+// everything a getaddrinfo_a() batch points into.  Lives on the heap: a
+// lookup gai_cancel() could not stop keeps running in the resolver thread,
+// reading the names and hints and writing its result, so such a batch is
+// never freed.
+struct resolve_batch {
+  string service;
+  vector<string> hosts;
+  struct addrinfo hints;
+  vector<struct gaicb> requests;
+  vector<struct gaicb*> request_list;
+};
+
+// resolve every bind host with getaddrinfo_a(), all lookups run in parallel
+// and we never wait longer than config.resolve_timeout_ms for a slow resolver.
+// "INADDR_ANY" is kept as an alias for 0.0.0.0, "[addr]" brackets are stripped.
+bool TCP_Server::resolve_bind_addresses(const vector<string> &localHosts, const uint16_t &localPort,
+                                        vector<struct sockaddr_storage> &addresses) {
+  resolve_batch *batch = new resolve_batch;
+  batch->service = to_string(localPort);
+  vector<string> &hosts = batch->hosts;
+  for ( auto host : localHosts ) {
+    if ( host == "INADDR_ANY" )
+      host = "0.0.0.0";
+    if ( host.size() > 2 && host.front() == '[' && host.back() == ']' )
+      host = host.substr(1, host.size() - 2);
+    hosts.push_back(host);
+  }
+
+  struct addrinfo &hints = batch->hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+  vector<struct gaicb> &requests = batch->requests;
+  vector<struct gaicb*> &request_list = batch->request_list;
+  requests.resize(hosts.size());
+  for ( size_t i = 0; i < hosts.size(); ++i ) {
+    memset(&requests[i], 0, sizeof(struct gaicb));
+    requests[i].ar_name = hosts[i].c_str();
+    requests[i].ar_service = batch->service.c_str();
+    requests[i].ar_request = &hints;
+    request_list.push_back(&requests[i]);
+  }
+
+  int rc = getaddrinfo_a(GAI_NOWAIT, request_list.data(), request_list.size(), NULL);
+  if ( rc != 0 ) {
+    std::cerr << "[E] getaddrinfo_a() failed: " << gai_strerror(rc) << "\n";
+    delete batch;
+    return false;
+  }
+
+  // wait for all lookups to finish, or the deadline to pass.
+  auto deadline = chrono::steady_clock::now() + chrono::milliseconds(config.resolve_timeout_ms);
+  bool ok = true;
+  bool abandoned = false; // some lookup is still running and owns the batch.
+  for ( size_t i = 0; i < request_list.size(); ++i ) {
+    while ( gai_error(request_list[i]) == EAI_INPROGRESS ) {
+      auto left = chrono::duration_cast<chrono::nanoseconds>(deadline - chrono::steady_clock::now());
+      if ( left.count() <= 0 )
+        break;
+      struct timespec ts;
+      ts.tv_sec = left.count() / 1000000000;
+      ts.tv_nsec = left.count() % 1000000000;
+      const struct gaicb *wait_list[] = { request_list[i] };
+      gai_suspend(wait_list, 1, &ts);
+    }
+    rc = gai_error(request_list[i]);
+    if ( rc == EAI_INPROGRESS ) {
+      std::cerr << "[E] timed out resolving hostname: " << hosts[i] << "\n";
+      if ( gai_cancel(request_list[i]) == EAI_NOTCANCELED )
+        abandoned = true;
+      ok = false;
+    } else if ( rc != 0 ) {
+      std::cerr << "[E] getaddrinfo() failed.  Unable to resolve hostname: " << hosts[i] << " (" << gai_strerror(rc) << ")\n";
+      ok = false;
+    } else {
+      // keep every address the host resolved to, skipping duplicates. (localhost -> ::1 and 127.0.0.1)
+      for ( struct addrinfo *ai = requests[i].ar_result; ai != NULL; ai = ai->ai_next ) {
+        struct sockaddr_storage address;
+        memset(&address, 0, sizeof(address));
+        memcpy(&address, ai->ai_addr, ai->ai_addrlen);
+        bool dup = false;
+        for ( auto &have : addresses )
+          if ( memcmp(&have, &address, sizeof(address)) == 0 )
+            dup = true;
+        if ( !dup )
+          addresses.push_back(address);
+      }
+    }
+  }
+
+  // a cancelled lookup may still own its result, only free finished ones.
+  for ( size_t i = 0; i < request_list.size(); ++i )
+    if ( gai_error(request_list[i]) != EAI_INPROGRESS && requests[i].ar_result != NULL ) {
+      freeaddrinfo(requests[i].ar_result);
+      requests[i].ar_result = NULL;
+    }
+  if ( abandoned )
+    std::cerr << "[W] leaving a stuck lookup to the resolver thread..\n";
+  else
+    delete batch;
+  return ok;
+}
+
+// create a socket for one address and bind it.  returns the fd or -1.
+int TCP_Server::bind_listener(const struct sockaddr_storage &address, bool v6only) {
+  socklen_t addrlen = address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  std::string hbuf(NI_MAXHOST, '\0');
+  std::string sbuf(NI_MAXSERV, '\0');
+  getnameinfo((const struct sockaddr*)&address, addrlen, const_cast<char*>(hbuf.data()), hbuf.size(),
+              const_cast<char*>(sbuf.data()), sbuf.size(), NI_NUMERICHOST | NI_NUMERICSERV);
+  hbuf.resize(strlen(hbuf.c_str()));
+  sbuf.resize(strlen(sbuf.c_str()));
+  if ( address.ss_family == AF_INET6 )
+    hbuf = "[" + hbuf + "]";
+  hbuf += ":" + sbuf;
+
+  int fd = socket(address.ss_family, SOCK_STREAM, 0);
+  if ( fd == -1 ) {
+    std::cerr << "[E] failed to create " << (address.ss_family == AF_INET6 ? "IPv6" : "IPv4") << " socket for " << hbuf << "..\n";
+    return -1;
+  }
+
+  // make it so we use our port if we are killed.
+  int sockoptsargs = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &sockoptsargs, sizeof(int)) < 0)
+     std::cerr << "[W] setsockopt(SO_REUSEADDR) failed.. May get bind error..\n";
+
+  // dual-stack: an IPv6 any listener also takes IPv4 clients unless told otherwise.
+  if ( address.ss_family == AF_INET6 )
+    set_socket_option(fd, IPPROTO_IPV6, IPV6_V6ONLY, v6only ? 1 : 0, "IPV6_V6ONLY");
+
+  // apply listener side of the socket profile.
+  apply_listener_profile(fd);
+
+  std::cout << "[N] setting up listener on: " << hbuf
+            << ( address.ss_family == AF_INET6 && !v6only ? " (dual-stack)" : "" ) << "\n";
+
+  // bind to port..
+  if ( bind( fd, (const struct sockaddr*)&address, addrlen ) != 0 ) {
+    std::cerr << "[E] failed to bind() to " << hbuf << ": " << strerror(errno) << "\n";
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// create the unix domain listener.  A stale socket file left by a previous
+// run is removed, anything else at path is an error.
+int TCP_Server::bind_unix_listener(const string &path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if ( path.size() >= sizeof(address.sun_path) ) {
+    std::cerr << "[E] unix socket path too long: " << path << "\n";
+    return -1;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  struct stat st;
+  if ( lstat(path.c_str(), &st) == 0 ) {
+    if ( !S_ISSOCK(st.st_mode) ) {
+      std::cerr << "[E] " << path << " exists and is not a socket..\n";
+      return -1;
+    }
+    unlink(path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if ( fd == -1 ) {
+    std::cerr << "[E] failed to create unix socket..\n";
+    return -1;
+  }
+
+  std::cout << "[N] setting up listener on: unix:" << path << "\n";
+
+  if ( bind( fd, (struct sockaddr*)&address, sizeof(address) ) != 0 ) {
+    std::cerr << "[E] failed to bind() to unix:" << path << ": " << strerror(errno) << "\n";
+    close(fd);
+    return -1;
+  }
+  if ( config.unix_mode >= 0 && chmod(path.c_str(), config.unix_mode) != 0 )
+    std::cerr << "[W] chmod(" << path << ") failed: " << strerror(errno) << "\n";
+  unix_listener_path = path;
+  return fd;
+}
+
+// create a socket per resolved address and bind to the interfaces. (doesn't not listen() ..)
+// the unix domain listener, if configured, is created last.
+int TCP_Server::create_and_bind(const vector<string> &localHosts, const uint16_t &localPort) {
+  vector<struct sockaddr_storage> addresses;
+
+  if ( !config.listen_tcp ) {
+    // unix socket only.
+  } else if ( localHosts.empty() ) {
+    // dual-stack any, unless this host has no IPv6 at all.
+    int probe = socket(AF_INET6, SOCK_STREAM, 0);
+    if ( probe != -1 ) {
+      close(probe);
+      if ( !resolve_bind_addresses( { string("::") }, localPort, addresses) )
+        return -1;
+    } else {
+      std::cerr << "[W] IPv6 not available, listening on IPv4 only..\n";
+      if ( !resolve_bind_addresses( { string("0.0.0.0") }, localPort, addresses) )
+        return -1;
+    }
+  } else if ( !resolve_bind_addresses(localHosts, localPort, addresses) ) {
+    return -1;
+  }
+
+  // an IPv6 wildcard would collide with an explicit IPv4 listener on the same port,
+  // keep it IPv6 only in that case.
+  bool have_ipv4 = false;
+  for ( auto &address : addresses )
+    if ( address.ss_family == AF_INET )
+      have_ipv4 = true;
+
+  for ( auto &address : addresses ) {
+    int fd = bind_listener(address, config.ipv6_only || have_ipv4);
+    if ( fd == -1 ) {
+      close_listeners();
+      return -1;
+    }
+    listener_fds.push_back(fd);
+  }
+
+  if ( !config.unix_path.empty() ) {
+    int fd = bind_unix_listener(config.unix_path);
+    if ( fd == -1 ) {
+      close_listeners();
+      return -1;
+    }
+    listener_fds.push_back(fd);
+  }
+
+  // admin and TLS ports listen on the same TCP addresses as the clients.
+  auto bind_port = [&](uint16_t port, vector<int> &fds) {
+    for ( auto address : addresses ) {
+      if ( address.ss_family == AF_INET6 )
+        ((struct sockaddr_in6*)&address)->sin6_port = htons(port);
+      else
+        ((struct sockaddr_in*)&address)->sin_port = htons(port);
+      int fd = bind_listener(address, config.ipv6_only || have_ipv4);
+      if ( fd == -1 )
+        return false;
+      fds.push_back(fd);
+    }
+    return true;
+  };
+  if ( config.admin_port != 0 && !bind_port(config.admin_port, admin_listener_fds) ) {
+    close_listeners();
+    return -1;
+  }
+  if ( config.peer_port != 0 && !bind_port(config.peer_port, peer_listener_fds) ) {
+    close_listeners();
+    return -1;
+  }
+  if ( config.tls_port != 0 ) {
+#ifdef TCP_SERVER_WITH_TLS
+    if ( !setup_tls() || !bind_port(config.tls_port, tls_listener_fds) ) {
+      close_listeners();
+      return -1;
+    }
+    listener_fds.insert(listener_fds.end(), tls_listener_fds.begin(), tls_listener_fds.end());
+#else
+    std::cerr << "[E] TLS port requested but built without TCP_SERVER_WITH_TLS..\n";
+    close_listeners();
+    return -1;
+#endif
+  }
+  if ( !setup_compression() || !open_journal() ) {
+    close_listeners();
+    return -1;
+  }
+  return listener_fds.empty() ? -1 : 0;
+}
+
+bool TCP_Server::setup_compression() {
+  return compressor.setup_zstd(config.zstd_dict_file, config.zstd_level);
+}
+
+bool TCP_Server::open_journal() {
+  return config.journal_dir.empty() ||
+         journal.open(config.journal_dir, config.journal_segment_bytes, config.journal_max_segments);
+}
+
+// close every listener socket. (bind failure or shutdown)
+void TCP_Server::close_listeners() {
+  for ( auto lfd : listener_fds )
+    close(lfd);
+  for ( auto lfd : admin_listener_fds )
+    close(lfd);
+  for ( auto lfd : peer_listener_fds )
+    close(lfd);
+  for ( auto lfd : tls_listener_fds ) // not yet in listener_fds if setup failed half way.
+    if ( find(listener_fds.begin(), listener_fds.end(), lfd) == listener_fds.end() )
+      close(lfd);
+  listener_fds.clear();
+  admin_listener_fds.clear();
+  peer_listener_fds.clear();
+  tls_listener_fds.clear();
+}
+
+// tell if fd is one of our listener sockets.
+bool TCP_Server::is_listener(int fd) {
+  return find(listener_fds.begin(), listener_fds.end(), fd) != listener_fds.end();
+}
+
+// make a socket nonblocking.
+bool TCP_Server::make_socket_nonblocking( int socketfd) {
+  int flags = fcntl(socketfd, F_GETFL, 0);
+  if (flags == -1) {
+    std::cerr << "[E] fcntl failed (F_GETFL)\n";
+    return false;
+  }
+
+  flags |= O_NONBLOCK;
+  int s = fcntl(socketfd, F_SETFL, flags);
+  if (s == -1) {
+    std::cerr << "[E] fcntl failed (F_SETFL)\n";
+    return false;
+  }
+  return true; 
+}
+
+// set a single integer socket option.
+// returns false (and warns) if the kernel refused it.
+bool TCP_Server::set_socket_option(int fd, int level, int option, int value, const char *name) {
+  if (setsockopt(fd, level, option, &value, sizeof(int)) < 0) {
+    std::cerr << "[W] setsockopt(" << name << "=" << value << ") failed on socket " << fd << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  return true;
+}
+
+// listener options.  Buffer sizes set here are inherited by accepted
+// sockets; TCP_DEFER_ACCEPT and TCP_FASTOPEN only mean something on a listener.
+void TCP_Server::apply_listener_profile(int fd) {
+  if (config.profile.sndbuf > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, config.profile.sndbuf, "SO_SNDBUF");
+  if (config.profile.rcvbuf > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, config.profile.rcvbuf, "SO_RCVBUF");
+  if (config.profile.defer_accept >= 0)
+    set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, config.profile.defer_accept, "TCP_DEFER_ACCEPT");
+  if (config.profile.fastopen_qlen > 0)
+    set_socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, config.profile.fastopen_qlen, "TCP_FASTOPEN");
+}
+
+// per-connection options, applied right after accept().
+// only the buffer sizes make sense for unix domain clients.
+void TCP_Server::apply_client_profile(int fd) {
+  auto it = clients.find(fd);
+  if ( it != clients.end() && it->second.family == AF_UNIX ) {
+    if (config.profile.sndbuf > 0)
+      set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, config.profile.sndbuf, "SO_SNDBUF");
+    if (config.profile.rcvbuf > 0)
+      set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, config.profile.rcvbuf, "SO_RCVBUF");
+    return;
+  }
+  if (config.profile.tcp_nodelay)
+    set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  if (config.profile.sndbuf > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, config.profile.sndbuf, "SO_SNDBUF");
+  if (config.profile.rcvbuf > 0)
+    set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, config.profile.rcvbuf, "SO_RCVBUF");
+  if (config.profile.tcp_quickack)
+    set_socket_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+  if (config.profile.notsent_lowat > 0)
+    set_socket_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, config.profile.notsent_lowat, "TCP_NOTSENT_LOWAT");
+  if (config.profile.keepalive) {
+    set_socket_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1, "SO_KEEPALIVE");
+    if (config.profile.keepidle > 0)
+      set_socket_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, config.profile.keepidle, "TCP_KEEPIDLE");
+    if (config.profile.keepintvl > 0)
+      set_socket_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, config.profile.keepintvl, "TCP_KEEPINTVL");
+    if (config.profile.keepcnt > 0)
+      set_socket_option(fd, IPPROTO_TCP, TCP_KEEPCNT, config.profile.keepcnt, "TCP_KEEPCNT");
+  }
+}
+
+// called by event_worker to accept new connections
+// called when a new connect event occurs.
+// This accepts the connection,
+// makes the new clientfd nonblocking,
+// adds the clientfd to epoll system.
+// returns new clientfd value.
+int TCP_Server::accept_connection(int socketfd, struct epoll_event& event, int epollfd) {
+  struct sockaddr_storage in_addr;
+  socklen_t in_len = sizeof(in_addr);
+  int infd = accept(socketfd, (struct sockaddr*)&in_addr, &in_len);
+  if (infd == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) // Done processing incoming connections
+    {
+      return -1;
+    }
+    else
+    {
+      std::cerr << "[E] accept failed\n";
+      return -1;
+    }
+  }
+  client_connection conn;
+  conn.fd = infd;
+  conn.family = in_addr.ss_family;
+
+  // refuse before doing any other work, reconnect storms should be cheap to turn away.
+  if ( !admit_connection(in_addr, conn) ) {
+    static const char busy[] = "server busy, try again later\r\n";
+    if ( write(infd, busy, sizeof(busy) - 1) < 0 ) {
+      // best effort, closing anyway.
+    }
+    close(infd);
+    stats->add(metric_rejected, 1);
+    return -1;
+  }
+
+  if ( conn.family == AF_UNIX ) {
+    // unix peers have no address worth printing, identify them by their credentials instead.
+    socklen_t cred_len = sizeof(conn.cred);
+    if ( getsockopt(infd, SOL_SOCKET, SO_PEERCRED, &conn.cred, &cred_len) == 0 ) {
+      conn.has_cred = true;
+      conn.peer = "unix:pid=" + to_string(conn.cred.pid) + ",uid=" + to_string(conn.cred.uid) + ",gid=" + to_string(conn.cred.gid);
+    } else {
+      conn.peer = "unix:unknown";
+    }
+    std::cout << "[I] Accepted connection as client " << infd << "(" << conn.peer << ")" << "\n";
+  } else {
+    scratch_string hbuf(NI_MAXHOST, '\0');
+    scratch_string sbuf(NI_MAXSERV, '\0');
+    if (getnameinfo((struct sockaddr*)&in_addr, in_len,
+                    const_cast<char*>(hbuf.data()), hbuf.size(),
+                    const_cast<char*>(sbuf.data()), sbuf.size(),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+    {
+      hbuf.resize(strlen(hbuf.c_str()));
+      sbuf.resize(strlen(sbuf.c_str()));
+      std::cout << "[I] Accepted connection as client " << infd << "(host=" << hbuf << ", port=" << sbuf << ")" << "\n";
+      conn.peer.assign(hbuf.data(), hbuf.size()).append(":").append(sbuf.data(), sbuf.size());
+    }
+  }
+
+  if (!make_socket_nonblocking(infd))
+  {
+    std::cerr << "[E] make_socket_nonblocking failed\n";
+    clients[infd] = conn;
+    stats->add(metric_connections, 1); // close_client() counts it off again.
+    close_client(infd);
+    return -1;
+  }
+
+#ifdef TCP_SERVER_WITH_TLS
+  if ( find(tls_listener_fds.begin(), tls_listener_fds.end(), socketfd) != tls_listener_fds.end() ) {
+    conn.ssl = SSL_new(tls_ctx);
+    if ( conn.ssl == nullptr || SSL_set_fd(conn.ssl, infd) != 1 ) {
+      std::cerr << "[E] SSL_new failed for client " << infd << "\n";
+      // close_client() gives the admission slot back and frees the session (no close_notify).
+      conn.tls_handshaking = true;
+      clients[infd] = conn;
+      stats->add(metric_connections, 1);
+      close_client(infd);
+      return -1;
+    }
+    SSL_set_accept_state(conn.ssl);
+    conn.tls_handshaking = true;
+  }
+#endif
+
+  uint64_t now_ns = trace_clock_ns();
+  conn.message_rate.configure(config.client_rate_messages, 0, now_ns);
+  conn.byte_rate.configure(config.client_rate_bytes, 0, now_ns);
+
+  clients[infd] = conn;
+  stats->add(metric_accepts, 1);
+  stats->add(metric_connections, 1);
+
+  apply_client_profile(infd);
+
+  // add accepted connection FD to epoll list..
+  event.data.fd = infd;
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+  clients[infd].epoll_events = event.events;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, infd, &event) == -1)
+  {
+    std::cerr << "[E] epoll_ctl failed\n";
+    close_client(infd);
+    return -1;
+  } 
+  return infd;
+}
+
+// admission control.  Unix domain clients only count against max_connections.
+// returns false if the connection must be refused.
+bool TCP_Server::admit_connection(const struct sockaddr_storage &addr, client_connection &conn) {
+  if ( config.max_connections > 0 && (int)clients.size() >= config.max_connections )
+    return false;
+
+  if ( config.max_connections_per_ip <= 0 && config.connect_rate_per_ip <= 0 )
+    return true;
+  if ( !admission_table::make_key(addr, conn.ip_key) )
+    return true;
+
+  uint64_t now_ns = trace_clock_ns();
+  auto *e = admission.find_or_insert(conn.ip_key, config.connect_burst_per_ip, config.connect_rate_per_ip, now_ns);
+
+  if ( config.max_connections_per_ip > 0 && (int)e->connections >= config.max_connections_per_ip )
+    return false;
+
+  if ( config.connect_rate_per_ip > 0 ) {
+    e->tokens = min(config.connect_burst_per_ip, e->tokens + (now_ns - e->refill_ns) * 1e-9 * config.connect_rate_per_ip);
+    e->refill_ns = now_ns;
+    if ( e->tokens < 1.0 )
+      return false;
+    e->tokens -= 1.0;
+  }
+
+  e->connections++;
+  conn.ip_tracked = true;
+  return true;
+}
+
+// remove client from client list and close the socket.
+// closing the fd also removes it from the epoll set.
+void TCP_Server::close_client(int fd) {
+  if ( fanout.contains(fd) ) {
+    std::cerr << "[I] Removed client " << fd << " from client list..\n";
+    fanout.remove(fd); // remove client form list
+    subscriptions_changed(clients[fd].channel_mask, 0);
+  }
+  auto cit = clients.find(fd);
+  if ( cit != clients.end() ) {
+    // last words (close frames, error replies) may still sit in the coalescing queue.
+    if ( !cit->second.out.empty() ) {
+      if ( write(fd, cit->second.out.data(), cit->second.out.size()) < 0 ) {
+        // best effort, closing anyway.
+      }
+      stats->add(metric_out_queued, -(int64_t)cit->second.out.size());
+    }
+    if ( cit->second.ip_tracked ) {
+      auto *e = admission.find(cit->second.ip_key);
+      if ( e != nullptr && e->connections > 0 )
+        e->connections--;
+    }
+#ifdef TCP_SERVER_WITH_TLS
+    if ( cit->second.ssl != nullptr ) {
+      if ( !cit->second.tls_handshaking )
+        SSL_shutdown(cit->second.ssl); // best effort close_notify, we do not wait for the peer's.
+      SSL_free(cit->second.ssl);
+    }
+#endif
+    clients.erase(cit);
+    stats->add(metric_connections, -1);
+  }
+  close(fd);
+}
+
+// send one message to a client, compressed and/or in a WebSocket frame if that is what it takes.
+ssize_t TCP_Server::send_to_client(int fd, const void *buf, size_t len) {
+  auto cit = clients.find(fd);
+  if ( cit != clients.end() && ( cit->second.websocket || cit->second.codec != codec_none ) ) {
+    scratch_string wire;
+    append_wire(wire, cit->second, (const char*)buf, len);
+    return write_to_client(fd, wire.data(), wire.size());
+  }
+  return write_to_client(fd, buf, len);
+}
+
+bool TCP_Server::pack_message(compression_codec codec, const char *buf, size_t len, scratch_string &packed) {
+  if ( !compressor.compress(codec, buf, len, packed) ) {
+    std::cerr << "[E] " << codec_names[codec] << " failed on a " << len << " byte message, not sent\n";
+    return false;
+  }
+  stats->add(metric_compress_in, len);
+  stats->add(metric_compress_out, packed.size());
+  return true;
+}
+
+void TCP_Server::append_wire(scratch_string &out, const client_connection &conn, const char *buf, size_t len) {
+  if ( conn.codec == codec_none ) {
+    if ( conn.websocket )
+      out += ws_frame(buf, len);
+    else
+      out.append(buf, len);
+    return;
+  }
+  scratch_string packed;
+  if ( !pack_message(conn.codec, buf, len, packed) )
+    return;
+  if ( conn.websocket )
+    out += ws_frame(packed.data(), packed.size(), true);
+  else
+    out += packed;
+}
+
+// write a whole message to a client.  The socket is nonblocking, anything the
+// kernel would not take right now is dropped and counted.
+ssize_t TCP_Server::write_to_client(int fd, const void *buf, size_t len) {
+  auto cit = clients.find(fd);
+#ifdef TCP_SERVER_WITH_TLS
+  // with kernel TLS the plain write() below is already encrypted by the kernel.
+  if ( cit != clients.end() && cit->second.ssl != nullptr && !cit->second.ktls_send )
+    return tls_send(cit->second, buf, len);
+#endif
+  // once output is queued (coalescing, replayed history) the rest queues behind it.
+  if ( cit != clients.end() && ( config.coalesce || !cit->second.out.empty() ) )
+    return queue_output(cit->second, buf, len);
+  ssize_t n = write(fd, buf, len);
+  if ( n > 0 )
+    stats->add(metric_bytes_out, n);
+  if ( n == (ssize_t)len )
+    stats->add(metric_messages_out, 1);
+  else
+    stats->add(metric_drops, 1);
+  return n;
+}
+
+// With coalescing every message is appended to the client's out queue and
+// the client goes on flush_list once.  flush_coalesced() then writes each
+// queue with a single write(): a burst of N messages to M clients costs M
+// syscalls (and usually M packets) instead of N * M.  Whatever the socket
+// does not take stays queued behind EPOLLOUT, up to out_max_pending.
+ssize_t TCP_Server::queue_output(client_connection &conn, const void *buf, size_t len) {
+  if ( conn.out.size() + len > config.out_max_pending ) {
+    stats->add(metric_drops, 1);
+    return -1;
+  }
+  conn.out.append((const char*)buf, len);
+  fanout.set_pending(conn.fd, conn.out.size());
+  stats->add(metric_messages_out, 1);
+  stats->add(metric_out_queued, len);
+  if ( !conn.in_flush_list ) {
+    if ( flush_list.empty() )
+      flush_deadline_ns = trace_clock_ns() + (uint64_t)config.coalesce_us * 1000;
+    conn.in_flush_list = true;
+    flush_list.push_back(conn.fd);
+  }
+  return len;
+}
+
+void TCP_Server::flush_output(int fd) {
+  client_connection &conn = clients[fd];
+  while ( !conn.out.empty() ) {
+    ssize_t n = write(fd, conn.out.data(), conn.out.size());
+    if ( n <= 0 )
+      break; // EAGAIN waits for EPOLLOUT, real errors show up as EPOLLERR/EPOLLHUP.
+    stats->add(metric_out_writes, 1);
+    stats->add(metric_bytes_out, n);
+    stats->add(metric_out_queued, -n);
+    conn.out.erase(0, n);
+  }
+  fanout.set_pending(fd, conn.out.size());
+  conn.out_blocked = !conn.out.empty();
+  update_epoll_interest(fd);
+  if ( conn.out.empty() && conn.replaying )
+    continue_replay(fd);
+}
+
+void TCP_Server::flush_coalesced() {
+  // flushing can queue more (the next replay slice), that waits for the next round.
+  vector<int> list;
+  list.swap(flush_list);
+  for ( auto fd : list ) {
+    auto it = clients.find(fd);
+    if ( it == clients.end() || !it->second.in_flush_list ) // closed (or fd reused) meanwhile
+      continue;
+    it->second.in_flush_list = false;
+    // a client waiting on EPOLLOUT is flushed from there.
+    if ( !it->second.out_blocked )
+      flush_output(fd);
+  }
+}
+
+// admin connections are not clients, they never see broadcasts.
+void TCP_Server::accept_admin_connection(int socketfd, int epollfd) {
+  int infd = accept4(socketfd, NULL, NULL, SOCK_NONBLOCK);
+  if ( infd == -1 ) {
+    if ( errno != EAGAIN && errno != EWOULDBLOCK )
+      std::cerr << "[E] admin accept failed\n";
+    return;
+  }
+  struct epoll_event ev;
+  ev.data.fd = infd;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+  if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, infd, &ev) == -1 ) {
+    std::cerr << "[E] epoll_ctl failed\n";
+    close(infd);
+    return;
+  }
+  admin_conns[infd] = string();
+}
+
+void TCP_Server::close_admin(int fd) {
+  admin_conns.erase(fd);
+  close(fd);
+}
+
+// minimal HTTP/1.0 style handler, one request per connection.
+//   GET /metrics -- Prometheus text format
+//   GET /healthz -- 200 while the worker is running, 503 otherwise
+//   GET /latency -- event loop latency histogram dump
+void TCP_Server::handle_admin_request(int fd) {
+  string &request = admin_conns[fd];
+  char buf[1024];
+  int size = read(fd, buf, sizeof(buf));
+  if ( size <= 0 ) {
+    close_admin(fd);
+    return;
+  }
+  request.append(buf, size);
+  if ( request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos ) {
+    if ( request.size() > 8192 ) // nobody needs headers that big.
+      close_admin(fd);
+    return;
+  }
+
+  string method, path;
+  istringstream(request) >> method >> path;
+
+  string status = "200 OK";
+  string type = "text/plain; charset=utf-8";
+  string body;
+  if ( method != "GET" ) {
+    status = "405 Method Not Allowed";
+    body = "method not allowed\n";
+  } else if ( path == "/metrics" ) {
+    type = "text/plain; version=0.0.4; charset=utf-8";
+    body = render_prometheus(metrics.snapshot());
+    body += "# HELP tcp_server_up Event worker is running.\n# TYPE tcp_server_up gauge\n";
+    body += string("tcp_server_up ") + ( worker_state.load() ? "1" : "0" ) + "\n";
+  } else if ( path == "/latency" ) {
+    body = latency_report();
+  } else if ( path == "/healthz" ) {
+    if ( worker_state.load() && isRunning.load() ) {
+      body = "ok\n";
+    } else {
+      status = "503 Service Unavailable";
+      body = "worker not running\n";
+    }
+  } else {
+    status = "404 Not Found";
+    body = "not found\n";
+  }
+
+  ostringstream oss;
+  oss << "HTTP/1.1 " << status << "\r\n"
+      << "Content-Type: " << type << "\r\n"
+      << "Content-Length: " << body.size() << "\r\n"
+      << "Connection: close\r\n\r\n"
+      << body;
+  string response = oss.str();
+  // small response into an empty socket buffer, a single write goes through.
+  if ( write(fd, response.data(), response.size()) != (ssize_t)response.size() )
+    std::cerr << "[W] short write on admin connection " << fd << "\n";
+  close_admin(fd);
+}
+
+// one line per histogram, times in microseconds.
+string TCP_Server::latency_report() const {
+  struct row { const char *name; const latency_histogram &h; double scale; const char *unit; };
+  const row rows[] = {
+    { "batch",       trace.batch_ns,          1000.0, "us" },
+    { "accept",      trace.accept_ns,         1000.0, "us" },
+    { "read",        trace.read_ns,           1000.0, "us" },
+    { "fanout",      trace.fanout_ns,         1000.0, "us" },
+    { "events/wake", trace.events_per_wakeup, 1.0,    ""   },
+  };
+  ostringstream oss;
+  oss.setf(ios::fixed);
+  oss.precision(1);
+  for ( auto &r : rows ) {
+    oss << "[L] " << r.name << " count=" << r.h.count()
+        << " p50=" << r.h.percentile(0.50) / r.scale << r.unit
+        << " p90=" << r.h.percentile(0.90) / r.scale << r.unit
+        << " p99=" << r.h.percentile(0.99) / r.scale << r.unit
+        << " p99.9=" << r.h.percentile(0.999) / r.scale << r.unit
+        << " max=" << r.h.max() / r.scale << r.unit;
+    if ( &r.h == &trace.events_per_wakeup )
+      oss << " (array " << metrics.snapshot()[metric_epoll_batch_size] << ", ceiling " << config.epoll_batch_max << ")";
+    oss << "\n";
+  }
+  return oss.str();
+}
+
+// forward one message to every client subscribed to the sender's channel, except the sender.
+// The WebSocket frame is built once, on the first WebSocket recipient, and
+// the same bytes go to all of them.
+// peers get the message as the client sent it, every node numbers its
+// channels itself.
+void TCP_Server::broadcast_message(int from_fd, const char *buf, size_t len) {
+  int channel = clients[from_fd].channel;
+  uint64_t id = next_message_id++;
+  if ( !peer_links.empty() )
+    forward_message(channel, 0, node_id, id, buf, len, -1);
+  deliver_message(channel, from_fd, buf, len);
+}
+
+void TCP_Server::deliver_message(int channel, int from_fd, const char *buf, size_t len) {
+  uint64_t channel_bit = 1ull << channel;
+  channel_state &chan = channels[channel];
+  // replaying clients only see what is in the journal, a message it cannot
+  // hold would be lost to them: nobody gets it.
+  if ( journal.is_open() && !journal.fits(chan.name.size(), len) ) {
+    std::cerr << "[W] dropping a " << len << " byte message on " << chan.name << ", longer than a journal segment\n";
+    stats->add(metric_drops, 1);
+    return;
+  }
+  uint64_t seq = chan.next_seq++;
+  chan.history.push(buf, len, seq, trace_clock_ns());
+  // when appending fails anyway (no new segment) replaying clients get it live.
+  bool journaled = !journal.is_open() || journal.append(chan.name, seq, buf, len) != 0;
+  // with sequence numbers on everybody gets the same prefixed copy.
+  scratch_string sequenced;
+  if ( config.sequence_numbers ) {
+    sequenced.append("[").append(chan.name.data(), chan.name.size()).append("#").append(to_string(seq).c_str()).append("] ");
+    sequenced.append(buf, len);
+    buf = sequenced.data();
+    len = sequenced.size();
+  }
+  // compressed copies (one per codec) and WebSocket frames are built the
+  // first time a recipient needs them and shared with everybody taking the same.
+  scratch_string packed[codec_count];
+  scratch_string ws_framed[codec_count];
+  // cerr is unbuffered: collect the recipients and log them with one write.
+  const bool verbose = config.verbose;
+  scratch_string recipients;
+  for ( size_t i = 0, count = fanout.size(); i < count; ++i ) {
+    // a replaying client reads this message from the journal when it gets there.
+    if ( !( fanout.mask(i) & channel_bit ) || ( journaled && ( fanout.flag(i) & fanout_registry::replaying ) ) )
+      continue;
+    int sendfd = fanout.fd(i);
+    if ( sendfd != from_fd ) {
+      // a full queue drops the message, no need to look at the connection.
+      uint32_t pending = fanout.pending(i);
+      if ( !( fanout.flag(i) & fanout_registry::framed ) && ( config.coalesce || pending > 0 ) &&
+           pending + len > config.out_max_pending ) {
+        stats->add(metric_drops, 1);
+        continue;
+      }
+      client_connection &to = fanout.connection(i);
+      if ( verbose )
+        recipients.append(to_string(sendfd).c_str()).append(" ");
+      const scratch_string *wire = nullptr;
+      if ( to.codec != codec_none ) {
+        scratch_string &p = packed[to.codec];
+        if ( p.empty() && !pack_message(to.codec, buf, len, p) )
+          continue;
+        wire = &p;
+      }
+      if ( to.websocket ) {
+        scratch_string &frame = ws_framed[to.codec];
+        if ( frame.empty() )
+          frame = wire != nullptr ? ws_frame(wire->data(), wire->size(), true) : ws_frame(buf, len);
+        wire = &frame;
+      }
+      if ( wire != nullptr )
+        write_to_client(sendfd, wire->data(), wire->size());
+      else
+        write_to_client(sendfd, buf, len );
+    }
+  } 
+  if ( verbose )
+    std::cerr << "  forwarding into clients: " << recipients << "\n";
+}
+
+// read and handle data from a client until the socket is drained or the
+// client used up its budget for this loop iteration.  Budgets keep one busy
+// sender from starving everybody else in the same epoll batch.
+TCP_Server::read_status TCP_Server::read_client(int fd, bool tracing) {
+  size_t budget_bytes = 0;
+  uint64_t handled_before = messages_handled;
+  bool quickack = config.profile.tcp_quickack && clients[fd].family != AF_UNIX;
+
+#ifdef TCP_SERVER_WITH_TLS
+  if ( clients[fd].tls_handshaking ) {
+    read_status hs = tls_handshake(fd);
+    if ( hs != read_drained || clients[fd].tls_handshaking )
+      return hs;
+    // handshake done, the client may have sent data right behind it.
+  }
+  // the data a stuck SSL_write() was waiting for is here.
+  if ( clients[fd].tls_write_wants_read ) {
+    flush_tls_output(fd);
+    if ( clients.count(fd) == 0 )
+      return read_closed;
+  }
+#endif
+
+  while ( true ) {
+    if ( throttle_client(fd, trace_clock_ns()) )
+      return read_throttled;
+
+    // do stuff to read and handle input data from client.
+    uint64_t read_start = tracing ? trace_clock_ns() : 0;
+    uint64_t fanout_ns = 0;
+    char bufin[16 * 1024];
+    int size = client_read(clients[fd], bufin, sizeof(bufin));
+    if ( size < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+      return read_drained; // nothing (more) to read right now.
+    // quickack is not sticky, the kernel drops back to delayed acks.
+    if ( size > 0 && quickack ) {
+      set_socket_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+      quickack = false;
+    }
+    if ( size <= 0 ) {
+      // Socket read error. (0 or less bytes received.., seen on disconnect.. )
+      std::cerr << "Client " << fd << " read_error, closing socket..\n";
+      close_client(fd);
+      return read_closed;
+    }
+
+    stats->add(metric_bytes_in, size);
+    client_connection &conn = clients[fd];
+    bool open = ( conn.sniffing || conn.websocket ) ? ws_input(fd, bufin, size, tracing, fanout_ns)
+                                                     : frame_lines(fd, bufin, size, tracing, fanout_ns);
+    if ( !open )
+      return read_closed;
+    // read phase excludes the fan-out it triggered.
+    if ( tracing )
+      trace.read_ns.record(trace_clock_ns() - read_start - fanout_ns);
+
+    // a short read means the socket buffer is empty, skip the EAGAIN read.
+    // (for TLS only if OpenSSL holds no decrypted bytes either, epoll can't see those)
+    if ( size < (int)sizeof(bufin) ) {
+#ifdef TCP_SERVER_WITH_TLS
+      if ( clients[fd].ssl == nullptr || SSL_pending(clients[fd].ssl) == 0 )
+#endif
+      return read_drained;
+    }
+    budget_bytes += size;
+    if ( budget_bytes >= config.read_budget_bytes ||
+         messages_handled - handled_before >= (uint64_t)config.read_budget_messages )
+      return read_more;
+  }
+}
+
+void TCP_Server::push_ready(int fd) {
+  clients[fd].in_ready_list = true;
+  ready_list.push_back(fd);
+}
+
+bool TCP_Server::handle_message(int fd, const char *buf, size_t len, bool tracing, uint64_t &fanout_ns) {
+  if ( config.verbose )
+    std::cerr << "[N] received message of " << len << " bytes from client " << fd << "\n";
+  stats->add(metric_messages_in, 1);
+  ++messages_handled;
+  size_t text_len = len;
+  while ( text_len > 0 && ( buf[text_len - 1] == '\n' || buf[text_len - 1] == '\r' ) )
+    --text_len;
+  if ( text_len == 4 && memcmp("quit", buf, 4) == 0 ) {
+    std::cerr << "[I] client " << fd << " sent quit message. Closing socket..\n";
+    close_client(fd);
+    return false;
+  }
+
+  // charge the inbound limits, the next loop turn checks them.
+  client_connection &conn = clients[fd];
+  channel_state &chan = channels[conn.channel];
+  conn.message_rate.take(1);
+  conn.byte_rate.take(len);
+  chan.message_rate.take(1);
+  chan.byte_rate.take(len);
+
+  if ( handle_channel_command(fd, buf, len) || handle_since_command(fd, buf, len) ||
+       handle_replay_command(fd, buf, len) || handle_compress_command(fd, buf, len) )
+    return true;
+
+  uint64_t fanout_start = tracing ? trace_clock_ns() : 0;
+  broadcast_message(fd, buf, len);
+  if ( tracing ) {
+    uint64_t ns = trace_clock_ns() - fanout_start;
+    trace.fanout_ns.record(ns);
+    fanout_ns += ns;
+  }
+  return true;
+}
+
+// Lines are handled straight out of the read buffer, only a line split
+// across reads is copied into line_in until its '\n' arrives.
+bool TCP_Server::frame_lines(int fd, const char *buf, size_t len, bool tracing, uint64_t &fanout_ns) {
+  if ( !config.line_framing )
+    return handle_message(fd, buf, len, tracing, fanout_ns);
+
+  size_t pos = 0;
+  string &pending = clients[fd].line_in;
+  if ( !pending.empty() ) {
+    size_t nl = find_newline(buf, len);
+    // pending is always shorter than max_line_bytes, it is handed on once it gets there.
+    size_t take = min(nl == len ? len : nl + 1, config.max_line_bytes - pending.size());
+    pending.append(buf, take);
+    pos = take;
+    if ( ( take > 0 && buf[take - 1] == '\n' ) || pending.size() >= config.max_line_bytes ) {
+      string line;
+      line.swap(pending);
+      if ( !handle_message(fd, line.data(), line.size(), tracing, fanout_ns) )
+        return false;
+    }
+  }
+  while ( pos < len ) {
+    size_t n = min(len - pos, config.max_line_bytes);
+    size_t nl = find_newline(buf + pos, n);
+    if ( nl == n && n < config.max_line_bytes ) {
+      // no newline yet, keep the start of the line for the next read.
+      clients[fd].line_in.assign(buf + pos, n);
+      break;
+    }
+    size_t line_len = ( nl == n ) ? n : nl + 1;
+    if ( !handle_message(fd, buf + pos, line_len, tracing, fanout_ns) )
+      return false;
+    pos += line_len;
+  }
+  return true;
+}
+
+// A sniffing client decides its protocol with its first bytes: "GET " is an
+// HTTP upgrade request, anything else is a raw client whose bytes are its
+// first message.  After the upgrade ws_in collects frames until they are
+// complete; client frames must be masked, control frames are answered here.
+bool TCP_Server::ws_input(int fd, const char *buf, size_t len, bool tracing, uint64_t &fanout_ns) {
+  client_connection &conn = clients[fd];
+  conn.ws_in.append(buf, len);
+
+  if ( conn.sniffing ) {
+    static const char get[] = "GET ";
+    size_t cmp = min(conn.ws_in.size(), sizeof(get) - 1);
+    if ( conn.ws_in.compare(0, cmp, get, cmp) != 0 ) {
+      conn.sniffing = false;
+      string first;
+      first.swap(conn.ws_in);
+      client_ready(fd);
+      return frame_lines(fd, first.data(), first.size(), tracing, fanout_ns);
+    }
+    size_t end = conn.ws_in.find("\r\n\r\n");
+    if ( end == string::npos ) {
+      if ( conn.ws_in.size() > 8192 ) {
+        std::cerr << "[W] client " << fd << " sent an oversized HTTP request, closing..\n";
+        close_client(fd);
+        return false;
+      }
+      return true;
+    }
+    if ( !ws_handshake(fd, end + 4) )
+      return false;
+  }
+
+  // complete frames at the front of ws_in.
+  uint8_t *data = (uint8_t*)&conn.ws_in[0];
+  size_t size = conn.ws_in.size();
+  size_t pos = 0;
+  ws_frame_info f;
+  while ( ws_parse_header(data + pos, size - pos, f) ) {
+    if ( !f.masked ) {
+      ws_fail(fd, 1002); // protocol error
+      return false;
+    }
+    // control frames (close, ping, pong) are never fragmented and carry 125 bytes at most.
+    if ( ( f.opcode & 0x8 ) && ( !f.fin || f.payload_len > 125 ) ) {
+      ws_fail(fd, 1002);
+      return false;
+    }
+    if ( f.payload_len > ws_max_message || conn.ws_message.size() + f.payload_len > ws_max_message ) {
+      ws_fail(fd, 1009); // message too big
+      return false;
+    }
+    if ( size - pos < f.header_len + f.payload_len )
+      break;
+    char *payload = (char*)data + pos + f.header_len;
+    size_t plen = f.payload_len;
+    ws_unmask((uint8_t*)payload, plen, f.mask);
+    pos += f.header_len + plen;
+
+    switch ( f.opcode ) {
+      case ws_text:
+      case ws_binary:
+      case ws_continuation:
+        if ( ( f.opcode == ws_continuation ) != conn.ws_fragmented ) {
+          ws_fail(fd, 1002);
+          return false;
+        }
+        if ( f.fin && !conn.ws_fragmented ) {
+          if ( !handle_message(fd, payload, plen, tracing, fanout_ns) )
+            return false;
+          break;
+        }
+        conn.ws_message.append(payload, plen);
+        conn.ws_fragmented = !f.fin;
+        if ( f.fin ) {
+          string message;
+          message.swap(conn.ws_message);
+          if ( !handle_message(fd, message.data(), message.size(), tracing, fanout_ns) )
+            return false;
+        }
+        break;
+      case ws_ping: {
+        uint8_t header[10];
+        size_t hlen = ws_frame_header(header, ws_pong, plen);
+        string pong((const char*)header, hlen);
+        pong.append(payload, plen);
+        write_to_client(fd, pong.data(), pong.size());
+        break;
+      }
+      case ws_pong:
+        break;
+      case ws_close:
+        std::cerr << "[I] client " << fd << " closed the WebSocket. Closing socket..\n";
+        ws_fail(fd, 1000);
+        return false;
+      default:
+        ws_fail(fd, 1002);
+        return false;
+    }
+  }
+  // handle_message() may have replied to this client, conn is still valid.
+  conn.ws_in.erase(0, pos);
+  return true;
+}
+
+bool TCP_Server::ws_handshake(int fd, size_t request_len) {
+  client_connection &conn = clients[fd];
+  istringstream request(conn.ws_in.substr(0, request_len));
+  conn.ws_in.erase(0, request_len);
+
+  string line, key, version;
+  bool upgrade = false, connection_upgrade = false;
+  getline(request, line); // GET <path> HTTP/1.1
+  while ( getline(request, line) ) {
+    if ( !line.empty() && line.back() == '\r' )
+      line.pop_back();
+    size_t colon = line.find(':');
+    if ( colon == string::npos )
+      continue;
+    string name = line.substr(0, colon);
+    string value = line.substr(colon + 1);
+    value.erase(0, value.find_first_not_of(" \t"));
+    transform(name.begin(), name.end(), name.begin(), ::tolower);
+    string lower = value;
+    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    if ( name == "upgrade" )
+      upgrade = lower.find("websocket") != string::npos;
+    else if ( name == "connection" )
+      connection_upgrade = lower.find("upgrade") != string::npos;
+    else if ( name == "sec-websocket-key" )
+      key = value;
+    else if ( name == "sec-websocket-version" )
+      version = value;
+  }
+
+  string response;
+  if ( !upgrade || !connection_upgrade || key.empty() )
+    response = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  else if ( version != "13" )
+    response = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+  if ( !response.empty() ) {
+    std::cerr << "[W] client " << fd << " sent a bad WebSocket upgrade request, closing..\n";
+    write_to_client(fd, response.data(), response.size());
+    close_client(fd);
+    return false;
+  }
+
+  response = "HTTP/1.1 101 Switching Protocols\r\n"
+             "Upgrade: websocket\r\n"
+             "Connection: Upgrade\r\n"
+             "Sec-WebSocket-Accept: " + ws_accept_key(key) + "\r\n\r\n";
+  write_to_client(fd, response.data(), response.size());
+  std::cerr << "[I] client " << fd << " upgraded to WebSocket\n";
+  stats->add(metric_ws_upgrades, 1);
+  conn.sniffing = false;
+  conn.websocket = true;
+  client_ready(fd);
+  return true;
+}
+
+void TCP_Server::ws_fail(int fd, uint16_t code) {
+  uint8_t frame[4] = { 0x80 | ws_close, 2, (uint8_t)( code >> 8 ), (uint8_t)code };
+  write_to_client(fd, frame, sizeof(frame));
+  close_client(fd);
+}
+
+int TCP_Server::channel_id(const string &name) {
+  auto it = channel_ids.find(name);
+  if ( it != channel_ids.end() )
+    return it->second;
+  if ( (int)channels.size() >= ::max_channels || name.size() > max_channel_name )
+    return -1;
+  channel_state chan;
+  chan.name = name;
+  uint64_t now_ns = trace_clock_ns();
+  chan.message_rate.configure(config.channel_rate_messages, 0, now_ns);
+  chan.byte_rate.configure(config.channel_rate_bytes, 0, now_ns);
+  size_t keep = max(config.history_messages, config.sequence_numbers ? config.seq_retention : 0);
+  chan.history.configure(keep, config.history_bytes, (uint64_t)config.history_seconds * 1000000000);
+  channels.push_back(chan);
+  channel_ids[name] = channels.size() - 1;
+  return channels.size() - 1;
+}
+
+// "join <name>" subscribes to a channel and publishes to it from now on,
+// "leave <name>" unsubscribes.  Every client starts out in "default".
+bool TCP_Server::handle_channel_command(int fd, const char *buf, size_t len) {
+  scratch_string line(buf, len);
+  while ( !line.empty() && ( line.back() == '\n' || line.back() == '\r' ) )
+    line.pop_back();
+  bool join = line.compare(0, 5, "join ") == 0;
+  bool leave = line.compare(0, 6, "leave ") == 0;
+  if ( !join && !leave )
+    return false;
+
+  string name(line.c_str() + ( join ? 5 : 6 ));
+  client_connection &conn = clients[fd];
+  string reply;
+  bool replay = false;
+  if ( join ) {
+    int id = channel_id(name);
+    if ( name.size() > max_channel_name ) {
+      reply = "error: channel name too long\r\n";
+    } else if ( id < 0 ) {
+      reply = "error: too many channels\r\n";
+    } else {
+      replay = !( conn.channel_mask & ( 1ull << id ) );
+      conn.channel = id;
+      subscriptions_changed(conn.channel_mask, conn.channel_mask | ( 1ull << id ));
+      conn.channel_mask |= 1ull << id;
+      reply = "joined " + name + "\r\n";
+    }
+  } else {
+    auto it = channel_ids.find(name);
+    if ( it != channel_ids.end() ) {
+      subscriptions_changed(conn.channel_mask, conn.channel_mask & ~(1ull << it->second));
+      conn.channel_mask &= ~(1ull << it->second);
+    }
+    reply = "left " + name + "\r\n";
+  }
+  fanout.refresh(conn);
+  std::cerr << "[I] client " << fd << " " << line << "\n";
+  send_to_client(fd, reply.data(), reply.size());
+  if ( replay )
+    replay_history(fd, conn.channel);
+  return true;
+}
+
+// history goes out as one chunk through the client's output queue, so the
+// socket buffer of a fresh connection never truncates it and messages
+// broadcast meanwhile queue up behind it.
+void TCP_Server::replay_history(int fd, int channel) {
+  channel_state &chan = channels[channel];
+  if ( config.history_messages == 0 || chan.history.size() == 0 )
+    return;
+  // the ring may hold more for "since" than history_messages asks to replay.
+  uint64_t from = chan.next_seq > config.history_messages ? chan.next_seq - config.history_messages : 1;
+  client_connection &conn = clients[fd];
+  scratch_string chunk;
+  size_t count = 0;
+  chan.history.for_each(trace_clock_ns(), from, [&](uint64_t seq, const char *buf, size_t len) {
+    append_message(chunk, conn, chan.name, seq, buf, len);
+    ++count;
+  });
+  if ( chunk.empty() )
+    return;
+  std::cerr << "[I] replaying " << count << " messages of channel " << channels[channel].name << " to client " << fd << "\n";
+  queue_to_client(conn, chunk.data(), chunk.size());
+}
+
+void TCP_Server::append_message(scratch_string &out, const client_connection &conn, const string &channel,
+                                uint64_t seq, const char *buf, size_t len) {
+  if ( !config.sequence_numbers ) {
+    append_wire(out, conn, buf, len);
+    return;
+  }
+  scratch_string message;
+  message.append("[").append(channel.data(), channel.size()).append("#").append(to_string(seq).c_str()).append("] ");
+  message.append(buf, len);
+  append_wire(out, conn, message.data(), message.size());
+}
+
+// "compress <zstd|lz4|none>" switches the client's messages to that codec.
+// The answer "compress <codec> <dictionary id>" still comes in the old
+// format, everything after it in the new one.  "dict" sends "dict <id> <size>"
+// and the zstd dictionary, best fetched before switching to zstd.
+bool TCP_Server::handle_compress_command(int fd, const char *buf, size_t len) {
+  scratch_string line(buf, len);
+  while ( !line.empty() && ( line.back() == '\n' || line.back() == '\r' ) )
+    line.pop_back();
+  string reply;
+  if ( line == "dict" ) {
+    reply = "dict " + to_string(compressor.dictionary_id()) + " " + to_string(compressor.dictionary().size()) + "\r\n";
+    reply += compressor.dictionary();
+    send_to_client(fd, reply.data(), reply.size());
+    return true;
+  }
+  if ( line.compare(0, 9, "compress ") != 0 )
+    return false;
+  string name(line.c_str() + 9);
+  int codec = 0;
+  while ( codec < codec_count && name != codec_names[codec] )
+    ++codec;
+  if ( codec == codec_count || !compressor.available((compression_codec)codec) ) {
+    reply = "error: " + name + " not available\r\n";
+    send_to_client(fd, reply.data(), reply.size());
+    return true;
+  }
+  reply = "compress " + name + " " + to_string(codec == codec_zstd ? compressor.dictionary_id() : 0) + "\r\n";
+  send_to_client(fd, reply.data(), reply.size());
+  clients[fd].codec = (compression_codec)codec;
+  fanout.refresh(clients[fd]);
+  std::cerr << "[I] client " << fd << " compress " << name << "\n";
+  return true;
+}
+
+// "since <channel> <seq>": subscribe to <channel> (like join, without the
+// history replay) and resume after <seq>, the last sequence number the client
+// saw.  Answered with "resumed <channel> <next seq>" and the missed messages,
+// or "resync <channel> <next seq>" when they are no longer retained (or the
+// server restarted and counts from 1 again) and the client has to fetch its
+// state some other way.  Live broadcasts queue up behind either answer.
+bool TCP_Server::handle_since_command(int fd, const char *buf, size_t len) {
+  scratch_string line(buf, len);
+  while ( !line.empty() && ( line.back() == '\n' || line.back() == '\r' ) )
+    line.pop_back();
+  if ( line.compare(0, 6, "since ") != 0 )
+    return false;
+  size_t space = line.rfind(' ');
+  string name(line.c_str() + 6, space > 6 ? space - 6 : 0);
+  uint64_t seen = strtoull(line.c_str() + space + 1, nullptr, 10);
+  if ( !config.sequence_numbers || name.empty() ) {
+    string reply = !config.sequence_numbers ? "error: sequence numbers are off\r\n" : "error: since <channel> <seq>\r\n";
+    send_to_client(fd, reply.data(), reply.size());
+    return true;
+  }
+  int id = channel_id(name);
+  if ( id < 0 ) {
+    string reply = name.size() > max_channel_name ? "error: channel name too long\r\n" : "error: too many channels\r\n";
+    send_to_client(fd, reply.data(), reply.size());
+    return true;
+  }
+  client_connection &conn = clients[fd];
+  channel_state &chan = channels[id];
+  conn.channel = id;
+  subscriptions_changed(conn.channel_mask, conn.channel_mask | ( 1ull << id ));
+  conn.channel_mask |= 1ull << id;
+  fanout.refresh(conn);
+
+  uint64_t now_ns = trace_clock_ns();
+  uint64_t from = seen + 1;
+  uint64_t oldest = chan.history.oldest_seq(now_ns);
+  bool covered = from <= chan.next_seq && ( from == chan.next_seq || ( oldest != 0 && from >= oldest ) );
+  string status = ( covered ? "resumed " : "resync " ) + name + " " + to_string(chan.next_seq) + "\r\n";
+  scratch_string chunk;
+  append_wire(chunk, conn, status.data(), status.size());
+  size_t count = 0;
+  if ( covered )
+    chan.history.for_each(now_ns, from, [&](uint64_t seq, const char *msg, size_t msg_len) {
+      append_message(chunk, conn, chan.name, seq, msg, msg_len);
+      ++count;
+    });
+  std::cerr << "[I] client " << fd << " " << line << ": " << ( covered ? "resumed with " : "resync, " )
+            << count << " messages\n";
+  queue_to_client(conn, chunk.data(), chunk.size());
+  return true;
+}
+
+void TCP_Server::queue_to_client(client_connection &conn, const char *buf, size_t len) {
+#ifdef TCP_SERVER_WITH_TLS
+  if ( conn.ssl != nullptr && !conn.ktls_send ) {
+    if ( conn.tls_handshaking || conn.tls_out.size() + len > config.tls_max_pending ) {
+      stats->add(metric_drops, 1);
+      return;
+    }
+    conn.tls_out.append(buf, len);
+    stats->add(metric_messages_out, 1);
+    if ( !conn.in_tls_batch ) {
+      conn.in_tls_batch = true;
+      tls_batch.push_back(conn.fd);
+    }
+    return;
+  }
+#endif
+  queue_output(conn, buf, len);
+}
+
+// "replay <seq>" streams the journal from sequence number seq (or the oldest
+// one still kept) on the client's subscribed channels, then "replay end <next>"
+// where <next> is the sequence number the next broadcast gets.  Live
+// broadcasts are held back until then: they are in the journal too, so the
+// client sees every message once and in order.
+bool TCP_Server::handle_replay_command(int fd, const char *buf, size_t len) {
+  if ( len < 7 || memcmp(buf, "replay ", 7) != 0 )
+    return false;
+  client_connection &conn = clients[fd];
+  if ( !journal.is_open() ) {
+    static const char reply[] = "error: no journal\r\n";
+    send_to_client(fd, reply, sizeof(reply) - 1);
+    return true;
+  }
+  conn.replay_seq = max<uint64_t>(strtoull(string(buf + 7, len - 7).c_str(), nullptr, 10), journal.first_seq());
+  conn.replaying = true;
+  fanout.refresh(conn);
+  std::cerr << "[I] client " << fd << " replay from " << conn.replay_seq << "\n";
+  continue_replay(fd);
+  return true;
+}
+
+// one slice (about 256KB) per call, the next one is queued when the client's
+// output has drained, so a replay of millions of messages never holds more
+// than a slice in memory and other clients keep their turn.  Slices with
+// nothing for the client's channels are skipped right away, there would be
+// no drained output to wait for; after max_skipped_slices of them the client
+// goes on flush_list and the scan resumes in the next loop iteration.
+void TCP_Server::continue_replay(int fd) {
+  constexpr size_t replay_slice = 256 * 1024;
+  constexpr int max_skipped_slices = 16; // 4MB of other channels' records per call at most.
+  client_connection &conn = clients[fd];
+  scratch_string chunk;
+  string last_name;
+  bool last_wanted = false;
+  auto collect = [&](uint64_t, uint64_t channel_seq, const char *name, size_t name_len, const char *buf, size_t len) {
+    if ( last_name.size() != name_len || last_name.compare(0, name_len, name, name_len) != 0 ) {
+      last_name.assign(name, name_len);
+      auto it = channel_ids.find(last_name);
+      last_wanted = it != channel_ids.end() && ( conn.channel_mask & ( 1ull << it->second ) );
+    }
+    if ( !last_wanted )
+      return true;
+    append_message(chunk, conn, last_name, channel_seq, buf, len);
+    return true;
+  };
+  for ( int slices = 0; chunk.empty() && conn.replay_seq < journal.end_seq(); ++slices ) {
+    if ( slices == max_skipped_slices ) {
+      // nothing for this client so far, give the other connections their
+      // turn and go on from replay_seq in the next loop iteration.
+      if ( !conn.in_flush_list ) {
+        if ( flush_list.empty() )
+          flush_deadline_ns = trace_clock_ns();
+        conn.in_flush_list = true;
+        flush_list.push_back(fd);
+      }
+      return;
+    }
+    conn.replay_seq = journal.read(conn.replay_seq, replay_slice, collect);
+  }
+  if ( conn.replay_seq >= journal.end_seq() ) {
+    conn.replaying = false;
+    fanout.refresh(conn);
+    string done = "replay end " + to_string(journal.end_seq()) + "\r\n";
+    append_wire(chunk, conn, done.data(), done.size());
+  }
+  queue_to_client(conn, chunk.data(), chunk.size());
+}
+
+// over any of its limits (connection or channel), the client's EPOLLIN
+// interest is dropped until the slowest bucket has refilled.  Unread data
+// stays in the kernel and pushes back on the sender through TCP.
+bool TCP_Server::throttle_client(int fd, uint64_t now_ns) {
+  client_connection &conn = clients[fd];
+  channel_state &chan = channels[conn.channel];
+  if ( !conn.message_rate.limited() && !conn.byte_rate.limited() &&
+       !chan.message_rate.limited() && !chan.byte_rate.limited() )
+    return false;
+  conn.message_rate.refill(now_ns);
+  conn.byte_rate.refill(now_ns);
+  chan.message_rate.refill(now_ns);
+  chan.byte_rate.refill(now_ns);
+  uint64_t wait = max(max(conn.message_rate.wait_ns(1), conn.byte_rate.wait_ns(1)),
+                      max(chan.message_rate.wait_ns(1), chan.byte_rate.wait_ns(1)));
+  if ( wait == 0 )
+    return false;
+
+  conn.throttled_until_ns = now_ns + wait;
+  update_epoll_interest(fd);
+  throttled.push(make_pair(conn.throttled_until_ns, fd));
+  stats->add(metric_throttled, 1);
+  return true;
+}
+
+void TCP_Server::unthrottle_clients(uint64_t now_ns) {
+  while ( !throttled.empty() && throttled.top().first <= now_ns ) {
+    int fd = throttled.top().second;
+    uint64_t until = throttled.top().first;
+    throttled.pop();
+    auto it = clients.find(fd);
+    if ( it == clients.end() || it->second.throttled_until_ns != until ) // closed or fd reused
+      continue;
+    it->second.throttled_until_ns = 0;
+    update_epoll_interest(fd);
+#ifdef TCP_SERVER_WITH_TLS
+    // bytes OpenSSL already decrypted never show up as EPOLLIN.
+    if ( it->second.ssl != nullptr && SSL_pending(it->second.ssl) > 0 && !it->second.in_ready_list )
+      push_ready(fd);
+#endif
+  }
+}
+
+// EPOLLIN unless rate limited, EPOLLOUT while output is waiting for the socket.
+// only calls epoll_ctl() when the interest actually changes.
+void TCP_Server::update_epoll_interest(int fd) {
+  client_connection &conn = clients[fd];
+  uint32_t want = EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+  if ( conn.throttled_until_ns == 0 )
+    want |= EPOLLIN;
+#ifdef TCP_SERVER_WITH_TLS
+  // queued plaintext alone is no reason: the socket would report writable
+  // on every wakeup while the batch waits for flush_tls_batch().
+  if ( conn.tls_want_write )
+    want |= EPOLLOUT;
+  if ( conn.tls_write_wants_read )
+    want |= EPOLLIN;
+#endif
+  if ( conn.out_blocked )
+    want |= EPOLLOUT;
+  if ( want == conn.epoll_events )
+    return;
+  struct epoll_event ev;
+  ev.data.fd = fd;
+  ev.events = want;
+  if ( epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1 ) {
+    std::cerr << "[E] epoll_ctl (modify) failed for client " << fd << "\n";
+    return;
+  }
+  conn.epoll_events = want;
+}
+
+// with WebSocket enabled the welcome waits until we know which protocol to send it in.
+void TCP_Server::client_accepted(int fd) {
+  if ( !config.websocket ) {
+    client_ready(fd);
+    return;
+  }
+  client_connection &conn = clients[fd];
+  conn.sniffing = true;
+  conn.sniff_deadline_ns = trace_clock_ns() + (uint64_t)config.websocket_sniff_ms * 1000000;
+  sniffing.push_back(make_pair(conn.sniff_deadline_ns, fd));
+}
+
+// the sniff window is the same for everybody, so deadlines are queued in order.
+void TCP_Server::expire_sniffing(uint64_t now_ns) {
+  while ( !sniffing.empty() && sniffing.front().first <= now_ns ) {
+    int fd = sniffing.front().second;
+    uint64_t deadline = sniffing.front().first;
+    sniffing.pop_front();
+    auto it = clients.find(fd);
+    if ( it == clients.end() || !it->second.sniffing || it->second.sniff_deadline_ns != deadline ) // decided, closed or fd reused
+      continue;
+    it->second.sniffing = false;
+    client_ready(fd);
+    // a partial "GET " that never went on is just a raw message.
+    if ( !it->second.ws_in.empty() ) {
+      string first;
+      first.swap(it->second.ws_in);
+      uint64_t fanout_ns = 0;
+      frame_lines(fd, first.data(), first.size(), false, fanout_ns);
+    }
+  }
+}
+
+// client can take part in broadcasts now.  (right after accept, or after the TLS handshake)
+void TCP_Server::client_ready(int fd) {
+  fanout.add(clients[fd]);
+  subscriptions_changed(0, clients[fd].channel_mask);
+  // build message to send to client to tell them there client ID.
+  scratch_string mesg("you are client id:");
+  mesg.append(to_string(fd).c_str()).append("\r\n");
+  send_to_client(fd, (void*)mesg.c_str(), mesg.length() );
+  replay_history(fd, clients[fd].channel);
+}
+
+ssize_t TCP_Server::client_read(client_connection &conn, char *buf, size_t len) {
+#ifdef TCP_SERVER_WITH_TLS
+  if ( conn.ssl != nullptr ) {
+    int rc = SSL_read(conn.ssl, buf, (int)len);
+    if ( rc > 0 )
+      return rc;
+    int err = SSL_get_error(conn.ssl, rc);
+    if ( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if ( err == SSL_ERROR_ZERO_RETURN ) // close_notify from the peer
+      return 0;
+    errno = EIO;
+    return -1;
+  }
+#endif
+  return read(conn.fd, buf, len);
+}
+
+// EPOLLOUT on a client: finish a handshake or flush output that was waiting.
+void TCP_Server::client_writable(int fd) {
+  auto it = clients.find(fd);
+  if ( it == clients.end() )
+    return;
+#ifdef TCP_SERVER_WITH_TLS
+  if ( it->second.ssl != nullptr ) {
+    if ( it->second.tls_handshaking ) {
+      tls_handshake(fd);
+      return;
+    }
+    flush_tls_output(fd);
+    it = clients.find(fd);
+    if ( it == clients.end() )
+      return;
+  }
+#endif
+  if ( it->second.out_blocked )
+    flush_output(fd);
+}
+
+#ifdef TCP_SERVER_WITH_TLS
+////////////////////////////////////////////////////////////
+// TLS
+// OpenSSL drives the handshake on the non-blocking socket from the epoll loop.
+// With SSL_OP_ENABLE_KTLS and a kernel providing the "tls" ULP, OpenSSL installs
+// the session keys into the socket (TCP_ULP "tls") once the handshake is done.
+// From then on the kernel encrypts, so the broadcast fan-out writes the same
+// plaintext buffer to every TLS client with plain write() (sendfile and
+// zerocopy work as for plain sockets), and SSL_read() is a thin recvmsg().
+// Without kernel TLS we fall back to SSL_read()/SSL_write().
+//
+// Self-signed certificate for local testing:
+//   openssl req -x509 -newkey rsa:2048 -nodes -days 30 -subj /CN=localhost -keyout key.pem -out cert.pem
+//   ./tcp_epoll_server --tls-port 9443 --tls-cert cert.pem --tls-key key.pem
+//   openssl s_client -connect localhost:9443 -quiet
+//
+bool TCP_Server::setup_tls() {
+  tls_ctx = SSL_CTX_new(TLS_server_method());
+  if ( tls_ctx == nullptr ) {
+    std::cerr << "[E] SSL_CTX_new failed..\n";
+    return false;
+  }
+  SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+  // partial writes plus a moving buffer let us retry from our own pending buffer.
+  SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+  if ( config.tls_ktls )
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#else
+  if ( config.tls_ktls )
+    std::cerr << "[W] OpenSSL built without kernel TLS support, using userspace TLS..\n";
+#endif
+  if ( SSL_CTX_use_certificate_chain_file(tls_ctx, config.tls_cert_file.c_str()) != 1 ||
+       SSL_CTX_use_PrivateKey_file(tls_ctx, config.tls_key_file.c_str(), SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(tls_ctx) != 1 ) {
+    char err[256];
+    ERR_error_string_n(ERR_get_error(), err, sizeof(err));
+    std::cerr << "[E] failed to load TLS certificate/key (" << config.tls_cert_file << ", "
+              << config.tls_key_file << "): " << err << "\n";
+    SSL_CTX_free(tls_ctx);
+    tls_ctx = nullptr;
+    return false;
+  }
+  return true;
+}
+
+TCP_Server::read_status TCP_Server::tls_handshake(int fd) {
+  client_connection &conn = clients[fd];
+  int rc = SSL_do_handshake(conn.ssl);
+  if ( rc == 1 ) {
+    conn.tls_handshaking = false;
+    conn.tls_want_write = false;
+#ifndef OPENSSL_NO_KTLS
+    conn.ktls_send = BIO_get_ktls_send(SSL_get_wbio(conn.ssl));
+    conn.ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(conn.ssl));
+#endif
+    std::cerr << "[I] client " << fd << " TLS handshake done (" << SSL_get_version(conn.ssl) << ", "
+              << SSL_get_cipher_name(conn.ssl) << ", ktls send=" << conn.ktls_send
+              << " recv=" << conn.ktls_recv << ")\n";
+    stats->add(metric_tls_handshakes, 1);
+    if ( conn.ktls_send )
+      stats->add(metric_ktls_sessions, 1);
+    update_epoll_interest(fd);
+    client_accepted(fd);
+    return read_drained;
+  }
+  int err = SSL_get_error(conn.ssl, rc);
+  if ( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ) {
+    conn.tls_want_write = ( err == SSL_ERROR_WANT_WRITE );
+    update_epoll_interest(fd);
+    return read_drained;
+  }
+  char errbuf[256];
+  ERR_error_string_n(ERR_get_error(), errbuf, sizeof(errbuf));
+  std::cerr << "[E] TLS handshake failed for client " << fd << ": " << errbuf << "\n";
+  ERR_clear_error();
+  close_client(fd);
+  return read_closed;
+}
+
+// OpenSSL insists a write that returned WANT_WRITE is retried with the same
+// leading bytes, so whatever it did not take is kept in tls_out and new
+// messages queue behind it until the socket drains.
+//
+// Every TLS session has its own keys and record sequence numbers, so one
+// ciphertext can never be shared between recipients.  What can be saved is
+// the per message cost: with tls_batch_fanout messages are only appended to
+// tls_out here, and flush_tls_batch() encrypts each session's whole batch in
+// a single SSL_write() at the end of the loop iteration.  That is one pass
+// over the TLS recipients, full 16KB records through OpenSSL's AES-NI/AVX
+// GCM code instead of a tiny record (and a write()) per message.
+ssize_t TCP_Server::tls_send(client_connection &conn, const void *buf, size_t len) {
+  if ( conn.tls_handshaking || conn.tls_out.size() + len > config.tls_max_pending ) {
+    stats->add(metric_drops, 1);
+    return -1;
+  }
+  if ( !conn.tls_out.empty() || config.tls_batch_fanout ) {
+    conn.tls_out.append((const char*)buf, len);
+    stats->add(metric_messages_out, 1);
+    if ( config.tls_batch_fanout && !conn.in_tls_batch ) {
+      conn.in_tls_batch = true;
+      tls_batch.push_back(conn.fd);
+    }
+    return len;
+  }
+  stats->add(metric_tls_writes, 1);
+  int rc = SSL_write(conn.ssl, buf, (int)len);
+  if ( rc > 0 )
+    stats->add(metric_bytes_out, rc);
+  stats->add(metric_messages_out, 1);
+  if ( rc == (int)len )
+    return rc;
+  int err = rc > 0 ? SSL_ERROR_WANT_WRITE : SSL_get_error(conn.ssl, rc);
+  if ( err != SSL_ERROR_WANT_WRITE && err != SSL_ERROR_WANT_READ ) {
+    ERR_clear_error();
+    stats->add(metric_drops, 1);
+    return -1;
+  }
+  size_t done = rc > 0 ? rc : 0;
+  conn.tls_out.assign((const char*)buf + done, len - done);
+  conn.tls_want_write = ( err == SSL_ERROR_WANT_WRITE );
+  conn.tls_write_wants_read = ( err == SSL_ERROR_WANT_READ );
+  update_epoll_interest(conn.fd);
+  return len;
+}
+
+void TCP_Server::flush_tls_output(int fd) {
+  client_connection &conn = clients[fd];
+  conn.tls_want_write = false;
+  conn.tls_write_wants_read = false;
+  while ( !conn.tls_out.empty() ) {
+    stats->add(metric_tls_writes, 1);
+    int rc = SSL_write(conn.ssl, conn.tls_out.data(), (int)conn.tls_out.size());
+    if ( rc <= 0 ) {
+      int err = SSL_get_error(conn.ssl, rc);
+      if ( err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ ) {
+        conn.tls_want_write = ( err == SSL_ERROR_WANT_WRITE );
+        conn.tls_write_wants_read = ( err == SSL_ERROR_WANT_READ );
+        break;
+      }
+      ERR_clear_error();
+      std::cerr << "[E] TLS write failed for client " << fd << ". Closing socket..\n";
+      close_client(fd);
+      return;
+    }
+    stats->add(metric_bytes_out, rc);
+    conn.tls_out.erase(0, rc);
+  }
+  update_epoll_interest(fd);
+  if ( conn.tls_out.empty() && conn.replaying )
+    continue_replay(fd);
+}
+
+void TCP_Server::flush_tls_batch() {
+  vector<int> batch;
+  batch.swap(tls_batch);
+  for ( auto fd : batch ) {
+    auto it = clients.find(fd);
+    if ( it == clients.end() || !it->second.in_tls_batch ) // closed (or fd reused) meanwhile
+      continue;
+    it->second.in_tls_batch = false;
+    // also sessions waiting on EPOLLOUT: the socket may have drained since,
+    // and OpenSSL takes the retry with the same leading bytes.
+    flush_tls_output(fd);
+  }
+}
+#endif
+
+
+// sleep no longer than idle_ms, nor past the next throttled client's resume
+// time, the next sniffing client's deadline or the coalescing window.
+// (epoll_wait() counts in milliseconds, shorter windows round up to 1ms)
+int TCP_Server::next_timeout_ms(int idle_ms) {
+  if ( !ready_list.empty() )
+    return 0;
+#ifdef TCP_SERVER_WITH_TLS
+  if ( !tls_batch.empty() ) // queued while flushing (next replay slice)
+    return 0;
+#endif
+  if ( throttled.empty() && sniffing.empty() && flush_list.empty() )
+    return idle_ms;
+  uint64_t now_ns = trace_clock_ns();
+  uint64_t next = UINT64_MAX;
+  if ( !flush_list.empty() )
+    next = flush_deadline_ns;
+  if ( !throttled.empty() )
+    next = min(next, throttled.top().first);
+  if ( !sniffing.empty() )
+    next = min(next, sniffing.front().first);
+  if ( next <= now_ns )
+    return 0;
+  return (int)min<uint64_t>(idle_ms, (next - now_ns + 999999) / 1000000);
+}
+
+////////////////////////////////////////////////////////////
+// Peer links
+// Links are ordinary nonblocking sockets in the worker's epoll set.  Frames
+// for a link are queued while the loop iteration runs and written with one
+// write() at its end, so a burst of broadcasts crosses a link in a few
+// large segments instead of one per message.
+//
+
+// resolve the configured peers once, the worker dials them and redials when a link drops.
+void TCP_Server::resolve_peers() {
+  for ( auto &address : config.peers ) {
+    peer_target target;
+    target.address = address;
+    memset(&target.addr, 0, sizeof(target.addr));
+    size_t colon = address.rfind(':');
+    if ( colon == string::npos ) {
+      std::cerr << "[E] peer " << address << " is not host:port, ignored..\n";
+      continue;
+    }
+    string host = address.substr(0, colon);
+    string port = address.substr(colon + 1);
+    if ( host.size() > 1 && host.front() == '[' && host.back() == ']' )
+      host = host.substr(1, host.size() - 2);
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    int rc = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+    if ( rc != 0 || res == NULL ) {
+      std::cerr << "[E] cannot resolve peer " << address << ": " << gai_strerror(rc) << ", ignored..\n";
+      continue;
+    }
+    memcpy(&target.addr, res->ai_addr, res->ai_addrlen);
+    target.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    peer_targets.push_back(target);
+  }
+}
+
+// start a connect() to every peer that is down and due for a retry.
+void TCP_Server::dial_peers(uint64_t now_ns) {
+  next_dial_ns = UINT64_MAX;
+  for ( size_t t = 0; t < peer_targets.size(); ++t ) {
+    peer_target &target = peer_targets[t];
+    if ( target.fd != -1 )
+      continue;
+    if ( target.retry_ns > now_ns ) {
+      next_dial_ns = min(next_dial_ns, target.retry_ns);
+      continue;
+    }
+    target.retry_ns = now_ns + peer_retry_ns;
+    next_dial_ns = min(next_dial_ns, target.retry_ns);
+    int fd = socket(target.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ( fd == -1 )
+      continue;
+    if ( connect(fd, (struct sockaddr*)&target.addr, target.addr_len) != 0 && errno != EINPROGRESS ) {
+      close(fd);
+      continue;
+    }
+    peer_link link;
+    link.fd = fd;
+    link.name = target.address;
+    link.target = t;
+    link.connecting = true;
+    peer_links[fd] = link;
+    target.fd = fd;
+    struct epoll_event ev;
+    ev.data.fd = fd;
+    ev.events = EPOLLOUT | EPOLLRDHUP | EPOLLERR | EPOLLHUP; // writable once connected.
+    peer_links[fd].epoll_events = ev.events;
+    if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+      std::cerr << "[E] epoll_ctl failed for peer link " << fd << "\n";
+      close_peer(fd);
+    }
+  }
+}
 
-// signal handling
-#include <signal.h>
+void TCP_Server::accept_peer(int socketfd) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  int fd = accept4(socketfd, (struct sockaddr*)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if ( fd == -1 ) {
+    if ( errno != EAGAIN && errno != EWOULDBLOCK )
+      std::cerr << "[E] peer accept failed\n";
+    return;
+  }
+  peer_link link;
+  link.fd = fd;
+  std::string hbuf(NI_MAXHOST, '\0');
+  std::string sbuf(NI_MAXSERV, '\0');
+  if ( getnameinfo((struct sockaddr*)&addr, addr_len, const_cast<char*>(hbuf.data()), hbuf.size(),
+                   const_cast<char*>(sbuf.data()), sbuf.size(), NI_NUMERICHOST | NI_NUMERICSERV) == 0 )
+    link.name = string(hbuf.c_str()) + ":" + sbuf.c_str();
+  peer_links[fd] = link;
+  struct epoll_event ev;
+  ev.data.fd = fd;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+  peer_links[fd].epoll_events = ev.events;
+  if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1 ) {
+    std::cerr << "[E] epoll_ctl failed for peer link " << fd << "\n";
+    close_peer(fd);
+    return;
+  }
+  std::cerr << "[N] peer link from " << link.name << " accepted..\n";
+  peer_connected(fd);
+}
 
-// default to search in std namespace.
-using namespace std;
+// the link is up, introduce ourselves.  Nothing else is sent before the hello.
+void TCP_Server::peer_connected(int fd) {
+  peer_link &link = peer_links[fd];
+  link.connecting = false;
+  set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY"); // batching is ours to do.
+  char version[4];
+  peer_put(version, peer_protocol_version, sizeof(version));
+  peer_frame(link.out, peer_hello, 0, node_id, 0, string(), version, sizeof(version));
+  peers_pending = true;
+  update_peer_interest(fd);
+}
 
-// used by main() loop to signal shutdown of server from OS signal.
-atomic<bool> AppRunning;
+void TCP_Server::update_peer_interest(int fd) {
+  peer_link &link = peer_links[fd];
+  uint32_t want = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+  if ( link.out_blocked )
+    want |= EPOLLOUT;
+  if ( want == link.epoll_events )
+    return;
+  struct epoll_event ev;
+  ev.data.fd = fd;
+  ev.events = want;
+  if ( epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1 ) {
+    std::cerr << "[E] epoll_ctl (modify) failed for peer link " << fd << "\n";
+    return;
+  }
+  link.epoll_events = want;
+}
 
-void sig_handler(int signo) {
-  // shutdown on any signal received.
-  AppRunning.store(false);
+void TCP_Server::close_peer(int fd) {
+  auto it = peer_links.find(fd);
+  if ( it != peer_links.end() ) {
+    bool was_up = it->second.node != 0;
+    if ( was_up ) {
+      std::cerr << "[W] peer link " << it->second.name << " down..\n";
+      stats->add(metric_peer_links, -1);
+    }
+    // the next dial is due a second after the last one, right away for a link that lived longer.
+    if ( it->second.target >= 0 ) {
+      peer_target &target = peer_targets[it->second.target];
+      target.fd = -1;
+      next_dial_ns = min(next_dial_ns, target.retry_ns);
+    }
+    peer_links.erase(it);
+    if ( was_up )
+      rebuild_ring();
+  }
+  close(fd);
 }
 
-// max number of epoll events to handle in 1 go..
-// This is the max number of events the kernel will dispatch
-// to us per epoll_wait() call..
-constexpr int tcp_epoll_max_events = 32;
+void TCP_Server::peer_event(int fd, uint32_t events) {
+  peer_link &link = peer_links[fd];
+  if ( link.connecting ) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if ( getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0 ) {
+      close_peer(fd);
+      return;
+    }
+    std::cerr << "[N] peer link to " << link.name << " connected..\n";
+    peer_connected(fd);
+    return;
+  }
+  if ( events & EPOLLOUT ) {
+    flush_peer(fd);
+    if ( peer_links.count(fd) == 0 )
+      return;
+  }
+  if ( events & EPOLLIN )
+    read_peer(fd);
+}
 
-////////////////////////////////////////////////////////////
-// TCP Server class
-// Use this class and extend it for your application..
-//
-class TCP_Server {
-  public:
-    //* constructor to define bind interface and port
-    TCP_Server(string localHost, uint16_t localPort);
-    //* constructor to define just local port, assumes 0.0.0.0 as local host.
-    TCP_Server(uint16_t localPort);
-    //* destructor
-    ~TCP_Server();
-    // tell if TCP server is running
-    bool isAlive() { return isRunning; }
-  private:
-    // socket used by listener to accept connections.
-    int socketfd;
-    // create socket and bind to interface.
-    int create_and_bind(const string &localHost, const uint16_t &localPort);
-    // make a socket not blocking.
-    bool make_socket_nonblocking( int socketfd);
-    // accept a new connection, add it to list of clients.
-    int accept_connection(int socketfd, struct epoll_event& event, int epollfd);
+// read what the link has (a few reads at most, level triggered epoll brings
+// us back for the rest) and handle every complete frame.
+void TCP_Server::read_peer(int fd) {
+  peer_link &link = peer_links[fd];
+  char buf[64 * 1024];
+  for ( int reads = 0; reads < 4; ++reads ) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+      break;
+    if ( n <= 0 ) {
+      close_peer(fd);
+      return;
+    }
+    link.in.append(buf, n);
+    if ( n < (ssize_t)sizeof(buf) )
+      break;
+  }
+  size_t pos = 0;
+  while ( link.in.size() - pos >= peer_header_bytes ) {
+    peer_header h;
+    peer_decode_header(link.in.data() + pos, h);
+    if ( h.len > peer_max_frame || h.channel_len > h.len || h.channel_len > max_channel_name ) {
+      std::cerr << "[E] peer link " << link.name << " sent a bad frame, closing..\n";
+      close_peer(fd);
+      return;
+    }
+    if ( link.in.size() - pos - peer_header_bytes < h.len )
+      break;
+    const char *body = link.in.data() + pos + peer_header_bytes;
+    pos += peer_header_bytes + h.len;
+    if ( !peer_frame_received(fd, h, body) )
+      return; // link closed
+  }
+  link.in.erase(0, pos);
+}
 
-    /////////////////////////////////////////////////////////////////////
-    // overload this function to handle events for your appplication..
-    // implements a simple echo server. Received messages are sent to all connected clients.
-    void event_worker();
+// false if the link got closed.
+bool TCP_Server::peer_frame_received(int fd, const peer_header &h, const char *body) {
+  peer_link &link = peer_links[fd];
+  if ( h.type == peer_hello ) {
+    if ( h.origin == node_id ) {
+      std::cerr << "[E] peer " << link.name << " is this server, not dialing it again..\n";
+      if ( link.target >= 0 )
+        peer_targets[link.target].retry_ns = UINT64_MAX;
+      close_peer(fd);
+      return false;
+    }
+    uint32_t version = h.len == 4 ? peer_get(body, 4) : 0; // peers from before versioning say nothing.
+    if ( version != peer_protocol_version ) {
+      std::cerr << "[E] peer link " << link.name << " speaks protocol version " << version << ", this server "
+                << peer_protocol_version << ", closing..\n";
+      close_peer(fd);
+      return false;
+    }
+    if ( link.node == 0 )
+      stats->add(metric_peer_links, 1);
+    link.node = h.origin;
+    std::cerr << "[N] peer link " << link.name << " is node " << hex << h.origin << dec << "\n";
+    rebuild_ring();
+    return true;
+  }
+  if ( link.node == 0 || ( h.type != peer_message && h.type != peer_subscribe && h.type != peer_unsubscribe ) ) {
+    std::cerr << "[E] peer link " << link.name << " did not say hello, closing..\n";
+    close_peer(fd);
+    return false;
+  }
+  if ( h.type != peer_message ) {
+    int channel = channel_id(string(body, h.channel_len));
+    if ( channel < 0 )
+      return true;
+    vector<uint64_t> &subs = channels[channel].peer_subscribers;
+    auto it = find(subs.begin(), subs.end(), link.node);
+    if ( h.type == peer_subscribe && it == subs.end() )
+      subs.push_back(link.node);
+    else if ( h.type == peer_unsubscribe && it != subs.end() )
+      subs.erase(it);
+    return true;
+  }
+  stats->add(metric_peer_messages_in, 1);
+  if ( h.origin == node_id || !seen_messages.first_sighting(h.origin, h.id, trace_clock_ns()) ) {
+    stats->add(metric_peer_duplicates, 1);
+    return true;
+  }
+  string name(body, h.channel_len);
+  int channel = channel_id(name);
+  if ( channel < 0 )
+    return true; // no room for another channel here.
+  const char *msg = body + h.channel_len;
+  size_t len = h.len - h.channel_len;
+  if ( h.hops + 1 < peer_max_hops )
+    forward_message(channel, h.hops + 1, h.origin, h.id, msg, len, fd);
+  deliver_message(channel, -1, msg, len);
+  return true;
+}
 
-    // internal methods to start/stop event_worker thread.
-    void start_event_worker();
-    void stop_event_worker();
-    // member datastructures
-    atomic<bool> worker_state; // 0 -- offline, 1 -- online, set by worker thread.
-    atomic<bool> isRunning; // when true, tells worker to keep running. False signals worker to stop.
-    thread epoll_worker; // worker thread running event_worker() method.
-    struct epoll_event event; // epoll event structure for configurating epoll
-    array<struct epoll_event, ::tcp_epoll_max_events> events; // list of events to handle from epoll_wait() call.
-    vector<int> client_fd_list; // list of connected client file descriptors.
-};
+// queue a message for every link but the one it came in on (and its origin's).
+void TCP_Server::relay_to_peers(const string &channel, uint8_t hops, uint64_t origin, uint64_t id,
+                                const char *buf, size_t len, int from_fd) {
+  string frame;
+  for ( auto &p : peer_links ) {
+    peer_link &link = p.second;
+    if ( p.first == from_fd || link.connecting || link.node == origin )
+      continue;
+    if ( frame.empty() )
+      peer_frame(frame, peer_message, hops, origin, id, channel, buf, len);
+    queue_to_peer(p.first, frame);
+  }
+}
 
-///////////////////////////////////////////////////////
-// Constructor specifing bind host and port
-TCP_Server::TCP_Server(string localHost, uint16_t localPort) {
-  if ( create_and_bind( localHost, localPort) == 0 ) {
-    // bound successfully, start event handling thread.
-    start_event_worker();
+// --channel-owners: a message that starts here (or was misrouted here while
+// nodes disagreed about the ring) goes to the owner, the owner passes it to
+// every node with subscribers.  Without owners every link gets everything.
+void TCP_Server::forward_message(int channel, uint8_t hops, uint64_t origin, uint64_t id,
+                                 const char *buf, size_t len, int from_fd) {
+  channel_state &chan = channels[channel];
+  if ( !config.channel_owners ) {
+    relay_to_peers(chan.name, hops, origin, id, buf, len, from_fd);
+    return;
+  }
+  string frame;
+  peer_frame(frame, peer_message, hops, origin, id, chan.name, buf, len);
+  uint64_t owner = ring.owner(chan.name);
+  if ( owner != node_id ) {
+    int fd = peer_fd(owner);
+    if ( fd != -1 && fd != from_fd && owner != origin )
+      queue_to_peer(fd, frame);
+    return;
+  }
+  for ( auto node : chan.peer_subscribers ) {
+    int fd = peer_fd(node);
+    if ( fd != -1 && fd != from_fd && node != origin )
+      queue_to_peer(fd, frame);
   }
 }
 
-//////////////////////////////////////////////////////
-// Constructor specifing port only, host 0.0.0.0 is assumed.
-TCP_Server::TCP_Server(uint16_t localPort) {
-  if ( create_and_bind( string("0.0.0.0"), localPort) == 0 ) {
-    // bound successfully, start event handling thread.
-    start_event_worker();
+// false if the link is too far behind to take it.
+bool TCP_Server::queue_to_peer(int fd, const string &frame) {
+  peer_link &link = peer_links[fd];
+  if ( link.out.size() + frame.size() > config.peer_max_pending ) {
+    stats->add(metric_peer_drops, 1);
+    return false;
   }
+  link.out += frame;
+  stats->add(metric_peer_messages_out, 1);
+  peers_pending = true;
+  return true;
 }
 
-//////////////////////////////////////////////////////
-// Destructor to shutdown service threads..
-TCP_Server::~TCP_Server() {
-  //signal shutdown of event_worker thread.  Wait for it finish.
-  stop_event_worker();
+// a link to node that finished its hello, -1 if there is none.
+int TCP_Server::peer_fd(uint64_t node) {
+  for ( auto &p : peer_links )
+    if ( p.second.node == node && !p.second.connecting )
+      return p.first;
+  return -1;
 }
 
-// create a IPv4 socket and bind to the interface. (doesn't not listen() ..)
-int TCP_Server::create_and_bind(const string &localHost, const uint16_t &localPort) {
-  // create TCP/IP V4 socket..
-  if (( socketfd=socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-    std::cerr << "[E] failed to create IPv4 socket..\n";
-    return -1;
+// membership changed: recompute owners and move our interest where it now belongs.
+void TCP_Server::rebuild_ring() {
+  if ( !config.channel_owners )
+    return;
+  vector<uint64_t> nodes(1, node_id);
+  for ( auto &p : peer_links )
+    if ( p.second.node != 0 && find(nodes.begin(), nodes.end(), p.second.node) == nodes.end() )
+      nodes.push_back(p.second.node);
+  ring.assign(nodes);
+  // interest of nodes that are gone is forgotten.
+  for ( auto &chan : channels ) {
+    auto &subs = chan.peer_subscribers;
+    subs.erase(remove_if(subs.begin(), subs.end(), [&](uint64_t node) {
+      return find(nodes.begin(), nodes.end(), node) == nodes.end();
+    }), subs.end());
   }
+  for ( size_t id = 0; id < channels.size(); ++id )
+    update_interest(id);
+}
 
-  // make it so we use our port if we are killed.
-  int sockoptsargs = 1;
-  if (setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &sockoptsargs, sizeof(int)) < 0)
-     std::cerr << "[W] setsockopt(SO_REUSEADDR) failed.. May get bind error..\n";
+// register the channel's local subscribers with its owner, or withdraw them.
+void TCP_Server::update_interest(int channel) {
+  if ( !config.channel_owners )
+    return;
+  channel_state &chan = channels[channel];
+  uint64_t want = chan.subscribers > 0 ? ring.owner(chan.name) : 0;
+  if ( want == node_id )
+    want = 0; // we own it, nobody to tell.
+  if ( want == chan.interest_node )
+    return;
+  string frame;
+  int fd;
+  if ( chan.interest_node != 0 && ( fd = peer_fd(chan.interest_node) ) != -1 ) {
+    peer_frame(frame, peer_unsubscribe, 0, node_id, 0, chan.name, "", 0);
+    queue_to_peer(fd, frame);
+  }
+  if ( want != 0 && ( fd = peer_fd(want) ) != -1 ) {
+    frame.clear();
+    peer_frame(frame, peer_subscribe, 0, node_id, 0, chan.name, "", 0);
+    queue_to_peer(fd, frame);
+  }
+  chan.interest_node = want;
+}
+
+// keep the subscriber count of every channel whose bit changed, the owner
+// hears about it when a count reaches or leaves 0.
+void TCP_Server::subscriptions_changed(uint64_t old_mask, uint64_t new_mask) {
+  uint64_t changed = old_mask ^ new_mask;
+  while ( changed != 0 ) {
+    int id = __builtin_ctzll(changed);
+    changed &= changed - 1;
+    channel_state &chan = channels[id];
+    bool was = chan.subscribers > 0;
+    chan.subscribers += ( new_mask & ( 1ull << id ) ) ? 1 : -1;
+    if ( was != ( chan.subscribers > 0 ) )
+      update_interest(id);
+  }
+}
+
+// end of loop iteration: one write() per link for everything queued meanwhile.
+void TCP_Server::flush_peers() {
+  peers_pending = false;
+  vector<int> due;
+  for ( auto &p : peer_links )
+    if ( !p.second.out.empty() && !p.second.out_blocked && !p.second.connecting )
+      due.push_back(p.first);
+  for ( auto fd : due )
+    flush_peer(fd);
+}
+
+void TCP_Server::flush_peer(int fd) {
+  peer_link &link = peer_links[fd];
+  while ( !link.out.empty() ) {
+    ssize_t n = send(fd, link.out.data(), link.out.size(), MSG_NOSIGNAL);
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+      break;
+    if ( n <= 0 ) {
+      close_peer(fd);
+      return;
+    }
+    stats->add(metric_peer_writes, 1);
+    link.out.erase(0, n);
+  }
+  link.out_blocked = !link.out.empty();
+  update_peer_interest(fd);
+}
 
-  // build address struct for bind to use..
-  struct sockaddr_in address;
-  memset(&address, 0, sizeof(sockaddr_in));
-  address.sin_family = AF_INET;
+////////////////////////////////////////////////////////////
+// Hot restart
+// A new server started with the same --upgrade-socket connects to the running
+// one, which passes it every listener, channel (sequence numbers and history)
+// and plain connection, waits for the acknowledgement, commits and exits.
+// The old server gives the whole exchange handoff_timeout_ns.  The
+// listeners never close, so connecting clients only see a short pause.
+//
 
-  std::cout << "Debug: localHost = \"" << localHost << "\"\n";
+// AF_UNIX SOCK_SEQPACKET listener for the next server, a stale socket file is replaced.
+int TCP_Server::bind_upgrade_listener(const string &path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if ( path.size() >= sizeof(address.sun_path) ) {
+    std::cerr << "[E] upgrade socket path too long: " << path << "\n";
+    return -1;
+  }
+  memcpy(address.sun_path, path.c_str(), path.size());
 
-  if ( localHost.compare("INADDR_ANY") != 0 ) {
-    // lookup provided hostname to address, use DNS/HOSTFILE if needed..
-    struct hostent *hp = gethostbyname(localHost.c_str());
-    if ( hp == NULL ) {
-      std::cerr << "[E] gethostbyname() failed.  Unable to resolve hostname: " << localHost << "\n";
+  struct stat st;
+  if ( lstat(path.c_str(), &st) == 0 ) {
+    if ( !S_ISSOCK(st.st_mode) ) {
+      std::cerr << "[E] " << path << " exists and is not a socket..\n";
       return -1;
     }
-    std::cout << "[N] setting up listener on: " << inet_ntoa( *(struct in_addr*)(hp->h_addr_list[0])) << ":" << localPort << "\n";
-    memcpy(&address.sin_addr, hp->h_addr_list[0], hp->h_length);
-  } else {
-    // bind to any interface 0.0.0.0
-    std::cout << "[N] setting up listener on: INADDR_ANY:" << localPort << "\n";
-    address.sin_addr.s_addr = INADDR_ANY; 
+    unlink(path.c_str());
   }
-  // use port provided..
-  address.sin_port = htons(localPort);
 
-  // bind to port..
-  if ( bind( socketfd, (struct sockaddr*)&address, sizeof(sockaddr_in) ) != 0 ) {
-    std::cerr << "[E] failed to bind() to interface..\n";
-    close(socketfd);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if ( fd == -1 ) {
+    std::cerr << "[E] failed to create upgrade socket..\n";
     return -1;
   }
-  return 0;
+  // whoever connects gets all our sockets: the file is 0600 from the moment
+  // it exists, and hand_over() checks the peer's uid on top.
+  mode_t old_mask = umask(0177);
+  int bound = bind( fd, (struct sockaddr*)&address, sizeof(address) );
+  umask(old_mask);
+  if ( bound != 0 || listen(fd, 1) != 0 ) {
+    std::cerr << "[E] failed to listen on upgrade socket " << path << ": " << strerror(errno) << "\n";
+    close(fd);
+    return -1;
+  }
+  std::cout << "[N] waiting for upgrades on: unix:" << path << "\n";
+  return fd;
 }
 
-// make a socket nonblocking.
-bool TCP_Server::make_socket_nonblocking( int socketfd) {
-  int flags = fcntl(socketfd, F_GETFL, 0);
-  if (flags == -1) {
-    std::cerr << "[E] fcntl failed (F_GETFL)\n";
+// connect to the server on path and receive its sockets.  false (and nothing
+// kept) if nobody is listening there or the handoff breaks off half way.
+bool TCP_Server::take_over(const string &path) {
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if ( path.size() >= sizeof(address.sun_path) )
+    return false;
+  memcpy(address.sun_path, path.c_str(), path.size());
+
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if ( sock == -1 )
+    return false;
+  if ( connect(sock, (struct sockaddr*)&address, sizeof(address)) != 0 ) {
+    std::cerr << "[I] no server on upgrade socket " << path << ", starting fresh..\n";
+    close(sock);
     return false;
   }
+  struct timeval tv = { 5, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  std::cerr << "[N] taking over from the server on " << path << "..\n";
 
-  flags |= O_NONBLOCK;
-  int s = fcntl(socketfd, F_SETFL, flags);
-  if (s == -1) {
-    std::cerr << "[E] fcntl failed (F_SETFL)\n";
+  bool complete = false;
+  handoff_record type;
+  string payload;
+  int fd;
+  while ( handoff_recv(sock, type, payload, fd) ) {
+    state_reader r(payload);
+    if ( type == handoff_end ) {
+      complete = true;
+      break;
+    } else if ( type == handoff_listener && fd != -1 ) {
+      uint64_t kind = r.u64();
+      string unix_path = r.str();
+      if ( kind == 'A' )
+        admin_listener_fds.push_back(fd);
+      else if ( kind == 'F' )
+        peer_listener_fds.push_back(fd);
+      else
+        listener_fds.push_back(fd);
+      if ( kind == 'T' )
+        tls_listener_fds.push_back(fd);
+      if ( !unix_path.empty() )
+        unix_listener_path = unix_path;
+    } else if ( type == handoff_channel ) {
+      int id = channel_id(r.str());
+      uint64_t next_seq = r.u64();
+      uint64_t count = r.u64();
+      if ( id < 0 )
+        continue;
+      channels[id].next_seq = next_seq;
+      uint64_t now_ns = trace_clock_ns();
+      for ( uint64_t i = 0; i < count && r.ok; ++i ) {
+        uint64_t seq = r.u64();
+        string msg = r.str();
+        channels[id].history.push(msg.data(), msg.size(), seq, now_ns);
+      }
+    } else if ( type == handoff_client && fd != -1 ) {
+      if ( !restore_client(fd, payload) )
+        close(fd);
+    } else if ( fd != -1 ) {
+      close(fd);
+    }
+  }
+
+#ifdef TCP_SERVER_WITH_TLS
+  if ( complete && !tls_listener_fds.empty() && !setup_tls() )
+    complete = false;
+#else
+  if ( complete && !tls_listener_fds.empty() ) {
+    std::cerr << "[E] got a TLS listener but built without TCP_SERVER_WITH_TLS..\n";
+    complete = false;
+  }
+#endif
+  if ( complete && ( !setup_compression() || !open_journal() ) )
+    complete = false;
+  // the old server keeps running until it sees the acknowledgement, and
+  // lets go of the sockets once it has sent its commit.
+  char commit = 0;
+  if ( complete && ( send(sock, "A", 1, MSG_NOSIGNAL) != 1 || recv(sock, &commit, 1, 0) != 1 || commit != 'C' ) )
+    complete = false;
+  close(sock);
+
+  if ( !complete ) {
+    std::cerr << "[E] takeover from " << path << " failed..\n";
+    for ( auto &c : clients )
+      close(c.first);
+    clients.clear();
+    fanout.clear();
+    sniffing.clear();
+    flush_list.clear();
+    close_listeners();
+    unix_listener_path.clear();
+    channels.clear();
+    channel_ids.clear();
+    admission = admission_table();
     return false;
   }
-  return true; 
+  std::cerr << "[N] took over " << listener_fds.size() + admin_listener_fds.size() << " listeners and "
+            << clients.size() << " connections..\n";
+  return true;
 }
 
-// called by event_worker to accept new connections
-// called when a new connect event occurs.
-// This accepts the connection,
-// makes the new clientfd nonblocking,
-// adds the clientfd to epoll system.
-// returns new clientfd value.
-int TCP_Server::accept_connection(int socketfd, struct epoll_event& event, int epollfd) {
-  struct sockaddr in_addr;
-  socklen_t in_len = sizeof(in_addr);
-  int infd = accept(socketfd, &in_addr, &in_len);
-  if (infd == -1) {
-    if (errno == EAGAIN || errno == EWOULDBLOCK) // Done processing incoming connections
-    {
-      return -1;
-    }
-    else
-    {
-      std::cerr << "[E] accept failed\n";
-      return -1;
-    }
+// rebuild one connection from its hand_over() record, registered with epoll once the worker starts.
+bool TCP_Server::restore_client(int fd, const string &state) {
+  state_reader r(state);
+  client_connection conn;
+  conn.fd = fd;
+  conn.family = (int)r.u64();
+  conn.peer = r.str();
+  conn.has_cred = r.u64() != 0;
+  string cred = r.str();
+  if ( cred.size() == sizeof(conn.cred) )
+    memcpy(&conn.cred, cred.data(), sizeof(conn.cred));
+  conn.ip_tracked = r.u64() != 0;
+  string key = r.str();
+  if ( key.size() == conn.ip_key.size() )
+    memcpy(conn.ip_key.data(), key.data(), key.size());
+  bool ready = r.u64() != 0;
+  conn.channel = max(channel_id(r.str()), 0);
+  conn.channel_mask = 0;
+  for ( uint64_t n = r.u64(); n > 0 && r.ok; --n ) {
+    int id = channel_id(r.str());
+    if ( id >= 0 )
+      conn.channel_mask |= 1ull << id;
   }
-  std::string hbuf(NI_MAXHOST, '\0');
-  std::string sbuf(NI_MAXSERV, '\0');
-  if (getnameinfo(&in_addr, in_len,
-                  const_cast<char*>(hbuf.data()), hbuf.size(),
-                  const_cast<char*>(sbuf.data()), sbuf.size(),
-                  NI_NUMERICHOST | NI_NUMERICSERV) == 0)
-  {
-    std::cout << "[I] Accepted connection as client " << infd << "(host=" << hbuf << ", port=" << sbuf << ")" << "\n";
+  conn.sniffing = r.u64() != 0;
+  conn.websocket = r.u64() != 0;
+  conn.ws_in = r.str();
+  conn.ws_message = r.str();
+  conn.ws_fragmented = r.u64() != 0;
+  conn.line_in = r.str();
+  string out = r.str();
+  conn.out.assign(out.data(), out.size());
+  conn.replaying = r.u64() != 0;
+  conn.replay_seq = r.u64();
+  uint64_t codec = r.u64();
+  conn.codec = codec < codec_count && compressor.available((compression_codec)codec) ? (compression_codec)codec : codec_none;
+  if ( !r.ok ) {
+    std::cerr << "[W] dropping connection " << fd << " with a damaged handoff record..\n";
+    return false;
   }
 
-  if (!make_socket_nonblocking(infd))
-  {
-    std::cerr << "[E] make_socket_nonblocking failed\n";
-    return -1;
+  uint64_t now_ns = trace_clock_ns();
+  conn.message_rate.configure(config.client_rate_messages, 0, now_ns);
+  conn.byte_rate.configure(config.client_rate_bytes, 0, now_ns);
+  if ( conn.ip_tracked )
+    admission.find_or_insert(conn.ip_key, config.connect_burst_per_ip, config.connect_rate_per_ip, now_ns)->connections++;
+  if ( conn.sniffing ) {
+    conn.sniff_deadline_ns = now_ns + (uint64_t)config.websocket_sniff_ms * 1000000;
+    sniffing.push_back(make_pair(conn.sniff_deadline_ns, fd));
   }
+  // pending output and journal replays pick up at the first flush.
+  if ( !conn.out.empty() || conn.replaying ) {
+    conn.in_flush_list = true;
+    flush_list.push_back(fd);
+  }
+  client_connection &stored = ( clients[fd] = conn );
+  if ( ready ) {
+    fanout.add(stored);
+    subscriptions_changed(0, conn.channel_mask);
+  }
+  return true;
+}
 
-  // add accepted connection FD to epoll list..
-  event.data.fd = infd;
-  event.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, infd, &event) == -1)
-  {
-    std::cerr << "[E] epoll_ctl failed\n";
-    return -1;
-  } 
-  return infd;
+// blocking on purpose, for handoff_timeout_ns at most: nothing else may happen
+// while the state moves.  On success the sockets belong to the new server
+// and the worker stops.  TLS sessions live in this process's OpenSSL state
+// and can't move, those clients are closed and have to reconnect.
+bool TCP_Server::hand_over(int sock) {
+  struct ucred peer;
+  socklen_t peer_len = sizeof(peer);
+  if ( getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 ||
+       ( peer.uid != geteuid() && peer.uid != 0 ) ) {
+    std::cerr << "[E] upgrade socket: peer uid " << peer.uid << " is not ours, refusing the handover..\n";
+    return false;
+  }
+  uint64_t deadline_ns = trace_clock_ns() + handoff_timeout_ns;
+  std::cerr << "[N] new server on the upgrade socket, handing over..\n";
+
+  bool sent = true;
+  auto send_listener = [&](int lfd, char kind) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    bool is_unix = getsockname(lfd, (struct sockaddr*)&addr, &addr_len) == 0 && addr.ss_family == AF_UNIX;
+    state_writer w;
+    w.u64(kind);
+    w.str(is_unix ? unix_listener_path : string());
+    sent = sent && handoff_send(sock, deadline_ns, handoff_listener, w.buf, lfd);
+  };
+  for ( auto lfd : listener_fds )
+    send_listener(lfd, find(tls_listener_fds.begin(), tls_listener_fds.end(), lfd) != tls_listener_fds.end() ? 'T' : 'P');
+  for ( auto lfd : admin_listener_fds )
+    send_listener(lfd, 'A');
+  for ( auto lfd : peer_listener_fds )
+    send_listener(lfd, 'F');
+
+  // in id order, so the new server hands out the same ids.
+  uint64_t now_ns = trace_clock_ns();
+  for ( auto &chan : channels ) {
+    state_writer w;
+    w.str(chan.name);
+    w.u64(chan.next_seq);
+    state_writer history;
+    uint64_t count = 0;
+    chan.history.for_each(now_ns, 0, [&](uint64_t seq, const char *p, size_t len) {
+      history.u64(seq);
+      history.str(string(p, len));
+      ++count;
+    });
+    w.u64(count);
+    w.buf += history.buf;
+    sent = sent && handoff_send(sock, deadline_ns, handoff_channel, w.buf);
+  }
+
+  vector<int> moved, tls_clients;
+  for ( auto &c : clients ) {
+    client_connection &conn = c.second;
+#ifdef TCP_SERVER_WITH_TLS
+    if ( conn.ssl != nullptr ) {
+      tls_clients.push_back(c.first);
+      continue;
+    }
+#endif
+    state_writer w;
+    w.u64(conn.family);
+    w.str(conn.peer);
+    w.u64(conn.has_cred);
+    w.str(string((const char*)&conn.cred, sizeof(conn.cred)));
+    w.u64(conn.ip_tracked);
+    w.str(string((const char*)conn.ip_key.data(), conn.ip_key.size()));
+    w.u64(fanout.contains(c.first));
+    w.str(channels[conn.channel].name);
+    uint64_t subscribed = 0;
+    state_writer names;
+    for ( size_t id = 0; id < channels.size(); ++id )
+      if ( conn.channel_mask & ( 1ull << id ) ) {
+        names.str(channels[id].name);
+        ++subscribed;
+      }
+    w.u64(subscribed);
+    w.buf += names.buf;
+    w.u64(conn.sniffing);
+    w.u64(conn.websocket);
+    w.str(conn.ws_in);
+    w.str(conn.ws_message);
+    w.u64(conn.ws_fragmented);
+    w.str(conn.line_in);
+    w.str(conn.out);
+    w.u64(conn.replaying);
+    w.u64(conn.replay_seq);
+    w.u64(conn.codec);
+    sent = sent && handoff_send(sock, deadline_ns, handoff_client, w.buf, c.first);
+    moved.push_back(c.first);
+  }
+  sent = sent && handoff_send(sock, deadline_ns, handoff_end, string());
+
+  // without our commit the new server drops everything it got, a handoff
+  // that times out here leaves no socket owned twice.
+  char ack = 0;
+  if ( !sent || !handoff_time_left(sock, deadline_ns) || recv(sock, &ack, 1, 0) != 1 || ack != 'A' ||
+       send(sock, "C", 1, MSG_NOSIGNAL) != 1 ) {
+    std::cerr << "[E] handover failed, carrying on..\n";
+    return false;
+  }
+
+  // the new server owns the sockets now, our copies just go away.
+  // Peer links are not handed over, the peers redial and the new server dials its own.
+  vector<int> links;
+  for ( auto &p : peer_links )
+    links.push_back(p.first);
+  for ( auto fd : links )
+    close_peer(fd);
+  for ( auto fd : tls_clients )
+    close_client(fd);
+  for ( auto fd : moved ) {
+    stats->add(metric_out_queued, -(int64_t)clients[fd].out.size());
+    clients.erase(fd);
+    close(fd);
+  }
+  stats->add(metric_connections, -(int64_t)moved.size());
+  fanout.clear();
+  ready_list.clear();
+  flush_list.clear();
+  sniffing.clear();
+#ifdef TCP_SERVER_WITH_TLS
+  tls_batch.clear();
+#endif
+  std::cerr << "[N] handed over " << moved.size() << " connections";
+  if ( !tls_clients.empty() )
+    std::cerr << ", closed " << tls_clients.size() << " TLS connections";
+  std::cerr << "..\n";
+  handed_over = true;
+  return true;
 }
 
 ////////////////////////////////////
@@ -259,34 +5146,104 @@ int TCP_Server::accept_connection(int socketfd, struct epoll_event& event, int e
 // Main Epoll event loop, process events from epoll_wait() call.
 void TCP_Server::event_worker() {
   // startup
-  // create listener
-  if ( listen(socketfd, SOMAXCONN) == -1 ) {
-    std::cerr << "[E] Failed to create socket listener.. Exit..\n";
-    return;
+  // create listeners
+  for ( auto socketfd : listener_fds ) {
+    if ( listen(socketfd, SOMAXCONN) == -1 ) {
+      std::cerr << "[E] Failed to create socket listener.. Exit..\n";
+      return;
+    }
   }
 
-  event.data.fd = socketfd; // class members..
-  event.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
-
-  int epollfd = epoll_create1(0);
+  epollfd = epoll_create1(0);
   if (epollfd == -1) {
     std::cerr << "[E] epoll_create1 failed..  Worker Exit..\n";
     return;
   }
-  
-  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, socketfd, &event) == -1 ) {
-    std::cerr << "[E] epoll_ctl add poll request failed..\n";
+
+  for ( auto socketfd : admin_listener_fds ) {
+    if ( listen(socketfd, SOMAXCONN) == -1 ) {
+      std::cerr << "[E] Failed to create admin listener.. Exit..\n";
+      return;
+    }
+  }
+  for ( auto socketfd : peer_listener_fds ) {
+    if ( listen(socketfd, SOMAXCONN) == -1 ) {
+      std::cerr << "[E] Failed to create peer listener.. Exit..\n";
+      return;
+    }
+  }
+
+  // all listeners share this one epoll set.
+  vector<int> all_listeners(listener_fds);
+  all_listeners.insert(all_listeners.end(), admin_listener_fds.begin(), admin_listener_fds.end());
+  all_listeners.insert(all_listeners.end(), peer_listener_fds.begin(), peer_listener_fds.end());
+  for ( auto socketfd : all_listeners ) {
+    event.data.fd = socketfd; // class members..
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, socketfd, &event) == -1 ) {
+      std::cerr << "[E] epoll_ctl add poll request failed..\n";
+      return;
+    }
+  }
+
+  stats = metrics.register_reactor();
+  if ( stats == nullptr ) {
+    std::cerr << "[E] no metrics slot for this worker..  Worker Exit..\n";
     return;
   }
+  channel_id("default");
+  resolve_peers();
+  if ( !peer_listener_fds.empty() || !peer_targets.empty() )
+    std::cerr << "[N] federation node id " << hex << node_id << dec << ", " << peer_targets.size() << " peers to dial..\n";
+
+  // connections handed over by the previous server.
+  size_t queued = 0;
+  for ( auto &c : clients ) {
+    queued += c.second.out.size();
+    event.data.fd = c.first;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP;
+    c.second.epoll_events = event.events;
+    if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, c.first, &event) == -1 )
+      std::cerr << "[E] epoll_ctl failed for handed over client " << c.first << "\n";
+  }
+  stats->add(metric_connections, clients.size());
+  stats->add(metric_out_queued, queued);
+  if ( upgrade_listener_fd != -1 ) {
+    event.data.fd = upgrade_listener_fd;
+    event.events = EPOLLIN;
+    if ( epoll_ctl(epollfd, EPOLL_CTL_ADD, upgrade_listener_fd, &event) == -1 )
+      std::cerr << "[E] epoll_ctl add for upgrade socket failed..\n";
+  }
+
+  epoll_batch_sizer batch_sizer(::tcp_epoll_max_events, config.epoll_batch_max);
+  events.resize(batch_sizer.size());
+  stats->add(metric_epoll_batch_size, batch_sizer.size());
 
   // signal to world that this thread is now running.
   worker_state.store(true);
 
   // loop until external service tells us to stop.
   while ( isRunning.load(memory_order_acquire) == true ) {
-    // wait untill kernel has between 1 - 32 events for us to process.
+    // wait untill kernel has between 1 - events.size() events for us to process.
     // timesout after 500 milliseconds. (for polling if thread should die or not.)
-    auto n = epoll_wait( epollfd, events.data(), ::tcp_epoll_max_events, 500 );
+    int batch_size = (int)events.size();
+    // don't sleep while connections still have unread data waiting in the ready list.
+    // nor past the time a rate limited client may be read again.
+    auto n = epoll_wait( epollfd, events.data(), batch_size, next_timeout_ms(500) );
+    if ( !throttled.empty() )
+      unthrottle_clients(trace_clock_ns());
+    if ( !sniffing.empty() )
+      expire_sniffing(trace_clock_ns());
+    if ( n > 0 ) {
+      stats->add(metric_epoll_wakeups, 1);
+      stats->add(metric_epoll_events, n);
+      if ( n == batch_size )
+        stats->add(metric_epoll_saturated, 1);
+    }
+    const bool tracing = config.latency_trace && ( n > 0 || !ready_list.empty() );
+    uint64_t batch_start = tracing ? trace_clock_ns() : 0;
+    if ( tracing )
+      trace.events_per_wakeup.record(n);
 
     // if timed out, n=0 and the for loop will not run..
     for (int i = 0; i < n; ++i)
@@ -295,25 +5252,61 @@ void TCP_Server::event_worker() {
 
       if (events[i].events & EPOLLERR ||
         events[i].events & EPOLLHUP ||
-        !(events[i].events & EPOLLIN)) // error
+        !(events[i].events & (EPOLLIN | EPOLLOUT))) // error
       {
         // got errorr event that was not part of an read event..
+        if ( admin_conns.count(events[i].data.fd) ) {
+          close_admin(events[i].data.fd);
+          continue;
+        }
+        if ( peer_links.count(events[i].data.fd) ) {
+          close_peer(events[i].data.fd);
+          continue;
+        }
         std::cerr << "[E] epoll event error detected from client " << events[i].data.fd << ".  Closing Socket..\n";
-        close(events[i].data.fd);
+        close_client(events[i].data.fd);
+      }
+      else if (events[i].data.fd == upgrade_listener_fd) // a new server wants to take over.
+      {
+        int sock = accept4(upgrade_listener_fd, NULL, NULL, SOCK_CLOEXEC);
+        if ( sock != -1 ) {
+          hand_over(sock);
+          close(sock);
+        }
+        if ( handed_over ) // the rest of this batch is about sockets we no longer own.
+          break;
+      }
+      else if (find(admin_listener_fds.begin(), admin_listener_fds.end(), events[i].data.fd) != admin_listener_fds.end())
+      {
+        accept_admin_connection(events[i].data.fd, epollfd);
+      }
+      else if (admin_conns.count(events[i].data.fd))
+      {
+        handle_admin_request(events[i].data.fd);
+      }
+      else if (find(peer_listener_fds.begin(), peer_listener_fds.end(), events[i].data.fd) != peer_listener_fds.end())
+      {
+        accept_peer(events[i].data.fd);
+      }
+      else if (peer_links.count(events[i].data.fd))
+      {
+        peer_event(events[i].data.fd, events[i].events);
       }
-      else if (socketfd == events[i].data.fd) // new connection, event fd is same as socketfd for listener.
+      else if (is_listener(events[i].data.fd)) // new connection, event fd is one of the listener sockets.
       {
         std::cerr << "[N] accepting a new connection..\n";
-        int newclientfd = accept_connection(socketfd, event, epollfd);
+        uint64_t accept_start = tracing ? trace_clock_ns() : 0;
+        int newclientfd = accept_connection(events[i].data.fd, event, epollfd);
         // if valid client ID, add to list and send welcome message.
+        // TLS clients join once their handshake is done.
         if ( newclientfd > 0 ) {
-          client_fd_list.push_back(newclientfd);
-          // build message to send to client to tell them there client ID.
-          ostringstream oss;
-          oss << "you are client id:" << newclientfd << "\r\n";
-          string mesg = oss.str();
-          write(newclientfd, (void*)mesg.c_str(), mesg.length() );
+#ifdef TCP_SERVER_WITH_TLS
+          if ( !clients[newclientfd].tls_handshaking )
+#endif
+          client_accepted(newclientfd);
         }
+        if ( tracing )
+          trace.accept_ns.record(trace_clock_ns() - accept_start);
       }
       else // data to read  (simple echo server..)  (EPOLLIN 0x0001 event..)
       {
@@ -321,50 +5314,79 @@ void TCP_Server::event_worker() {
         // TODO: technically if we have a disconnect, EPOLLHUP (0x2000) will also be set..
         // so we could skip the read and just close the socket if we wanted too..
 
-        // do stuff to read and handle input data from client.
-        char bufin[1024];
-        int size = read(fd, &bufin, 1024);
-        if ( size > 0 ) {
-          std::cerr << "[N] received message of " << size << " bytes from client " << fd << endl;
-          if ( ( size == 6 ) && ( memcmp("quit", &bufin, 4) == 0 )) {
-            std::cerr << "[I] client " << fd << " sent quit message. Closing socket..\n";
-            vector<int>::iterator it;
-            it = find(client_fd_list.begin(), client_fd_list.end(), fd);
-            if ( it != client_fd_list.end() ) {
-              std::cerr << "[I] Removed client " << fd << " from client list..\n";
-              client_fd_list.erase(it); // remove client form list
-            }
-            close(fd);
-          } else {
-            std::cerr << "  forwarding into clients: ";
-            for( auto sendfd : client_fd_list) {
-              if ( sendfd != fd) {
-                std::cerr << sendfd << " ";
-                write(sendfd, &bufin, size );
-              }
-            } 
-            std::cerr << "\n";
-          }
-        } else {
-          // Socket read error. (0 or less bytes received.., seen on disconnect.. )
-          std::cerr << "Client " << fd << " read_error, closing socket..\n";
-          vector<int>::iterator it;
-          it = find(client_fd_list.begin(), client_fd_list.end(), fd);
-          if ( it != client_fd_list.end() ) {
-            std::cerr << "[I] Removed client " << fd << " from client list..\n";
-            client_fd_list.erase(it); // remove client form list
-          }
-          close(fd);
+        if ( events[i].events & EPOLLOUT ) {
+          client_writable(fd);
+          if ( !(events[i].events & EPOLLIN) || clients.count(fd) == 0 )
+            continue;
         }
+
+        // already waiting in the ready list, it gets its next slice there.
+        auto it = clients.find(fd);
+        if ( it != clients.end() && it->second.in_ready_list )
+          continue;
+        if ( read_client(fd, tracing) == read_more )
+          push_ready(fd);
       }
     }
+
+    if ( handed_over ) {
+      isRunning.store(false);
+      break;
+    }
+
+    // revisit connections that used up their budget, one slice each, round-robin.
+    // anything still left over goes to the back of the list for the next iteration.
+    size_t ready_count = ready_list.size();
+    for ( size_t r = 0; r < ready_count; ++r ) {
+      int fd = ready_list.front();
+      ready_list.pop_front();
+      auto it = clients.find(fd);
+      if ( it == clients.end() || !it->second.in_ready_list ) // closed (or fd reused) meanwhile
+        continue;
+      it->second.in_ready_list = false;
+      if ( read_client(fd, tracing) == read_more )
+        push_ready(fd);
+    }
+#ifdef TCP_SERVER_WITH_TLS
+    if ( !tls_batch.empty() )
+      flush_tls_batch();
+#endif
+    if ( !flush_list.empty() && trace_clock_ns() >= flush_deadline_ns )
+      flush_coalesced();
+    if ( peers_pending )
+      flush_peers();
+    if ( !peer_targets.empty() && trace_clock_ns() >= next_dial_ns )
+      dial_peers(trace_clock_ns());
+    if ( tracing )
+      trace.batch_ns.record(trace_clock_ns() - batch_start);
+
+    // resize the event array for the next call, never while events[] is in use.
+    if ( n > 0 && batch_sizer.update(n) != batch_size ) {
+      stats->add(metric_epoll_batch_size, batch_sizer.size() - batch_size);
+      events.resize(batch_sizer.size());
+    }
+    iteration_scratch.reset(); // nothing allocated from scratch this round is used after it.
     cout << flush; // force screen up after this loop.
   }
 
   // shutdown
   std::cerr << "[N] Worker thread shutting down.." << std::endl;
   worker_state.store(false); // notify watchers that we are no longer running.
-  close(socketfd); // close listener socket and epoll requests.
+  close_listeners(); // close listener sockets and epoll requests.
+  for ( auto &admin : admin_conns )
+    close(admin.first);
+  admin_conns.clear();
+  for ( auto &link : peer_links )
+    close(link.first);
+  peer_links.clear();
+  // after a handover the paths belong to the new server.
+  if ( !unix_listener_path.empty() && !handed_over )
+    unlink(unix_listener_path.c_str());
+  if ( upgrade_listener_fd != -1 ) {
+    close(upgrade_listener_fd);
+    if ( !handed_over )
+      unlink(config.upgrade_socket.c_str());
+  }
   close(epollfd);
 }
 
@@ -385,15 +5407,240 @@ void TCP_Server::stop_event_worker() {
   std::cerr << "[N] server worker thread shutdown complete..\n";
 }
 
+/////////////////////////////////////
+// one line metrics report, counters shown as per second rates.
+void print_metrics(const metrics_snapshot &now, const metrics_snapshot &last) {
+  std::cerr << "[S]";
+  for ( int m = 0; m < metric_count; ++m ) {
+    if ( metric_table[m].gauge )
+      std::cerr << " " << metric_table[m].name << "=" << now.values[m];
+    else
+      std::cerr << " " << metric_table[m].name << "/s=" << (int64_t)now.rate(last, (metric_id)m);
+  }
+  int64_t wakeups = now[metric_epoll_wakeups] - last[metric_epoll_wakeups];
+  int64_t evts = now[metric_epoll_events] - last[metric_epoll_events];
+  std::cerr << " events_per_wakeup=" << (wakeups > 0 ? (double)evts / wakeups : 0.0) << "\n";
+}
+
+/////////////////////////////////////
+// command line usage
+void usage(const char *prog) {
+  std::cerr << "usage: " << prog << " [options]\n"
+            << "  -b, --bind <host>     listen on host/address (repeatable, default dual-stack any)\n"
+            << "  -p, --port <port>     listen port (default 9090)\n"
+            << "  -6, --ipv6-only       do not accept IPv4 clients on IPv6 any listeners\n"
+            << "  -u, --unix <path>     also listen on a unix domain stream socket\n"
+            << "      --no-tcp          serve the unix socket only\n"
+            << "  -s, --stats <secs>    print runtime metrics every <secs> seconds\n"
+            << "  -a, --admin-port <p>  serve HTTP /metrics, /healthz and /latency on port <p>\n"
+            << "  -L, --latency <secs>  print event loop latency histograms every <secs> seconds\n"
+            << "      --no-latency-trace  do not time the event loop\n"
+            << "  -v, --verbose         log every message and the clients it went to\n"
+            << "      --epoll-batch-max <n>  ceiling for the adaptive epoll event array (default 1024)\n"
+            << "      --max-conn <n>    refuse clients beyond <n> connections\n"
+            << "      --max-conn-per-ip <n>  refuse more than <n> concurrent connections per address\n"
+            << "      --connect-rate <r>[:<burst>]  per address connect rate limit (per second)\n"
+            << "      --client-rate <msgs>[:<bytes>]  inbound limit per connection, per second\n"
+            << "      --channel-rate <msgs>[:<bytes>]  inbound limit per channel, per second\n"
+            << "      --tls-port <p>    TLS listener on port <p> (needs --tls-cert and --tls-key)\n"
+            << "      --tls-cert <pem>  certificate chain file\n"
+            << "      --tls-key <pem>   private key file\n"
+            << "      --no-ktls         keep TLS in userspace, do not use kernel TLS\n"
+            << "      --no-tls-batch    encrypt every message separately instead of once per loop iteration\n"
+            << "      --no-line-framing  treat every read() as one message instead of splitting lines\n"
+            << "      --history <n>[:<secs>]  replay the last <n> messages (no older than <secs>) of a\n"
+            << "                        channel to clients joining it\n"
+            << "      --seq             prefix broadcasts with \"[<channel>#<seq>] \", clients resume\n"
+            << "                        with \"since <channel> <seq>\"\n"
+            << "      --seq-retention <n>  messages per channel kept for \"since\" (default 4096)\n"
+            << "      --journal <dir>   append every broadcast to a segmented journal in <dir>,\n"
+            << "                        clients catch up with \"replay <seq>\"\n"
+            << "      --journal-segment-mb <n>  journal segment file size (default 64)\n"
+            << "      --journal-segments <n>  journal segment files kept (default 16)\n"
+            << "      --coalesce[=<us>]  queue output per client, one write() per epoll batch\n"
+            << "                        (or per <us> microsecond window)\n"
+            << "      --peer-port <p>   accept federation links from other servers on port <p>\n"
+            << "      --peer <host:port>  link to the server whose --peer-port that is (repeatable),\n"
+            << "                        broadcasts are relayed between linked servers\n"
+            << "      --channel-owners  route each channel through its owner (consistent hashing) to\n"
+            << "                        the servers with subscribers only, links must form a full mesh\n"
+            << "      --zstd-dict <file>  dictionary for clients compressing with zstd (zstd --train)\n"
+            << "      --zstd-level <n>  zstd compression level (default 3)\n"
+            << "      --huge-pages <MB>  allocate connection state and output queues from a <MB>\n"
+            << "                        arena of 2MB pages (hugetlb if reserved, else transparent)\n"
+            << "      --huge-pages-prefault  fault the whole arena in at startup\n"
+            << "      --upgrade-socket <path>  hand over to / take over from the server on <path>\n"
+            << "                        (unix socket) without dropping connections; TLS clients reconnect\n"
+            << "      --no-nodelay      leave Nagle on for client sockets\n"
+            << "      --sndbuf <bytes>  SO_SNDBUF for listeners and clients\n"
+            << "      --rcvbuf <bytes>  SO_RCVBUF for listeners and clients\n"
+            << "      --quickack        TCP_QUICKACK after every read, no delayed acks\n"
+            << "      --notsent-lowat <bytes>  TCP_NOTSENT_LOWAT for clients\n"
+            << "      --defer-accept <secs>  TCP_DEFER_ACCEPT, wake on accept only once data arrived\n"
+            << "      --fastopen <qlen>  TCP_FASTOPEN on listeners with <qlen> pending requests\n"
+            << "      --keepalive[=<idle>:<intvl>:<cnt>]  SO_KEEPALIVE for clients, optionally with\n"
+            << "                        TCP_KEEPIDLE/TCP_KEEPINTVL (secs) and TCP_KEEPCNT\n"
+            << "  -w, --websocket       also accept WebSocket clients (HTTP upgrade) on every listener\n"
+            << "  -h, --help            show this help\n";
+}
+
 /////////////////////////////////////
 // Main
-int main() {
+#ifndef TCP_EPOLL_SERVER_NO_MAIN
+int main(int argc, char *argv[]) {
+  server_config config;
+  int stats_interval = 0;
+  int latency_interval = 0;
+  size_t huge_pages_mb = 0;
+  bool huge_pages_prefault = false;
+
+  static struct option long_options[] = {
+    { "bind",      required_argument, NULL, 'b' },
+    { "port",      required_argument, NULL, 'p' },
+    { "ipv6-only", no_argument,       NULL, '6' },
+    { "unix",      required_argument, NULL, 'u' },
+    { "no-tcp",    no_argument,       NULL, 'T' },
+    { "stats",     required_argument, NULL, 's' },
+    { "admin-port", required_argument, NULL, 'a' },
+    { "latency",   required_argument, NULL, 'L' },
+    { "no-latency-trace", no_argument, NULL, 'N' },
+    { "verbose",   no_argument,       NULL, 'v' },
+    { "no-nodelay", no_argument,      NULL, 'z' },
+    { "sndbuf",    required_argument, NULL, 'o' },
+    { "rcvbuf",    required_argument, NULL, 'i' },
+    { "quickack",  no_argument,       NULL, 'y' },
+    { "notsent-lowat", required_argument, NULL, 'n' },
+    { "defer-accept", required_argument, NULL, 'd' },
+    { "fastopen",  required_argument, NULL, 'q' },
+    { "keepalive", optional_argument, NULL, 'A' },
+    { "epoll-batch-max", required_argument, NULL, 'E' },
+    { "max-conn", required_argument, NULL, 'M' },
+    { "max-conn-per-ip", required_argument, NULL, 'I' },
+    { "connect-rate", required_argument, NULL, 'R' },
+    { "client-rate", required_argument, NULL, 'C' },
+    { "channel-rate", required_argument, NULL, 'H' },
+    { "tls-port",  required_argument, NULL, 'P' },
+    { "tls-cert",  required_argument, NULL, 'c' },
+    { "tls-key",   required_argument, NULL, 'k' },
+    { "no-ktls",   no_argument,       NULL, 'K' },
+    { "no-tls-batch", no_argument,    NULL, 'B' },
+    { "no-line-framing", no_argument, NULL, 'F' },
+    { "coalesce",  optional_argument, NULL, 'O' },
+    { "history",   required_argument, NULL, 'Y' },
+    { "seq",       no_argument,       NULL, 'S' },
+    { "seq-retention", required_argument, NULL, 'V' },
+    { "journal",   required_argument, NULL, 'J' },
+    { "journal-segment-mb", required_argument, NULL, 'G' },
+    { "journal-segments", required_argument, NULL, 'Q' },
+    { "upgrade-socket", required_argument, NULL, 'U' },
+    { "peer-port", required_argument, NULL, 'X' },
+    { "peer",      required_argument, NULL, 'Z' },
+    { "channel-owners", no_argument,  NULL, 'W' },
+    { "zstd-dict", required_argument, NULL, 'D' },
+    { "zstd-level", required_argument, NULL, 'l' },
+    { "huge-pages", required_argument, NULL, 'g' },
+    { "huge-pages-prefault", no_argument, NULL, 'f' },
+    { "websocket", no_argument,       NULL, 'w' },
+    { "help",      no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "b:p:6u:s:a:L:wvh", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 'b': config.bind_addresses.push_back(optarg); break;
+      case 'p': config.port = (uint16_t)atoi(optarg); break;
+      case '6': config.ipv6_only = true; break;
+      case 'u': config.unix_path = optarg; break;
+      case 'T': config.listen_tcp = false; break;
+      case 's': stats_interval = atoi(optarg); break;
+      case 'a': config.admin_port = (uint16_t)atoi(optarg); break;
+      case 'L': latency_interval = atoi(optarg); break;
+      case 'N': config.latency_trace = false; break;
+      case 'v': config.verbose = true; break;
+      case 'z': config.profile.tcp_nodelay = false; break;
+      case 'o': config.profile.sndbuf = atoi(optarg); break;
+      case 'i': config.profile.rcvbuf = atoi(optarg); break;
+      case 'y': config.profile.tcp_quickack = true; break;
+      case 'n': config.profile.notsent_lowat = atoi(optarg); break;
+      case 'd': config.profile.defer_accept = atoi(optarg); break;
+      case 'q': config.profile.fastopen_qlen = atoi(optarg); break;
+      case 'A': {
+        config.profile.keepalive = true;
+        if ( optarg != NULL ) {
+          config.profile.keepidle = atoi(optarg);
+          const char *intvl = strchr(optarg, ':');
+          if ( intvl != NULL ) {
+            config.profile.keepintvl = atoi(intvl + 1);
+            const char *cnt = strchr(intvl + 1, ':');
+            if ( cnt != NULL )
+              config.profile.keepcnt = atoi(cnt + 1);
+          }
+        }
+        break;
+      }
+      case 'E': config.epoll_batch_max = atoi(optarg); break;
+      case 'M': config.max_connections = atoi(optarg); break;
+      case 'I': config.max_connections_per_ip = atoi(optarg); break;
+      case 'R': {
+        config.connect_rate_per_ip = atof(optarg);
+        const char *burst = strchr(optarg, ':');
+        if ( burst != NULL )
+          config.connect_burst_per_ip = atof(burst + 1);
+        break;
+      }
+      case 'P': config.tls_port = (uint16_t)atoi(optarg); break;
+      case 'c': config.tls_cert_file = optarg; break;
+      case 'k': config.tls_key_file = optarg; break;
+      case 'K': config.tls_ktls = false; break;
+      case 'B': config.tls_batch_fanout = false; break;
+      case 'F': config.line_framing = false; break;
+      case 'O':
+        config.coalesce = true;
+        if ( optarg != NULL )
+          config.coalesce_us = atoi(optarg);
+        break;
+      case 'Y': {
+        config.history_messages = atoi(optarg);
+        const char *secs = strchr(optarg, ':');
+        if ( secs != NULL )
+          config.history_seconds = atoi(secs + 1);
+        break;
+      }
+      case 'S': config.sequence_numbers = true; break;
+      case 'V': config.seq_retention = atoi(optarg); break;
+      case 'J': config.journal_dir = optarg; break;
+      case 'G': config.journal_segment_bytes = (size_t)atoi(optarg) << 20; break;
+      case 'Q': config.journal_max_segments = atoi(optarg); break;
+      case 'U': config.upgrade_socket = optarg; break;
+      case 'X': config.peer_port = (uint16_t)atoi(optarg); break;
+      case 'Z': config.peers.push_back(optarg); break;
+      case 'W': config.channel_owners = true; break;
+      case 'D': config.zstd_dict_file = optarg; break;
+      case 'l': config.zstd_level = atoi(optarg); break;
+      case 'g': huge_pages_mb = atoi(optarg); break;
+      case 'f': huge_pages_prefault = true; break;
+      case 'w': config.websocket = true; break;
+      case 'C':
+      case 'H': {
+        const char *bytes = strchr(optarg, ':');
+        ( opt == 'C' ? config.client_rate_messages : config.channel_rate_messages ) = atof(optarg);
+        if ( bytes != NULL )
+          ( opt == 'C' ? config.client_rate_bytes : config.channel_rate_bytes ) = atof(bytes + 1);
+        break;
+      }
+      default: usage(argv[0]); return opt == 'h' ? 0 : -1;
+    }
+  }
+
   // register signal handler.
   signal(SIGINT, sig_handler);
   AppRunning.store(true);
 
+  // connection state has to come from the arena from the first client on.
+  if ( huge_pages_mb > 0 && !setup_connection_arena(huge_pages_mb << 20, huge_pages_prefault) )
+    return -1;
 
-  TCP_Server myTCPServer(9090);
+  TCP_Server myTCPServer(config);
   // wait 1 second before check to see if TCP_Server started correctly..
   std::this_thread::sleep_for (std::chrono::seconds(1)); 
   if (! myTCPServer.isAlive()) {
@@ -405,11 +5652,27 @@ int main() {
 
   std::cout << "Press Ctrl-C (SIGINT) to exit.." << std::endl;
 
-  while (AppRunning.load() == true) {
+  metrics_snapshot last = myTCPServer.get_metrics();
+  auto last_latency = std::chrono::steady_clock::now();
+  // runs until ctrl-c, or until a new server took over.
+  while (AppRunning.load() == true && myTCPServer.isAlive()) {
     // wait for ctrl-c to be pressed.
+    std::this_thread::sleep_for (std::chrono::milliseconds(100));
+    if ( stats_interval > 0 &&
+         std::chrono::steady_clock::now() - last.when >= std::chrono::seconds(stats_interval) ) {
+      metrics_snapshot now = myTCPServer.get_metrics();
+      print_metrics(now, last);
+      last = now;
+    }
+    if ( latency_interval > 0 &&
+         std::chrono::steady_clock::now() - last_latency >= std::chrono::seconds(latency_interval) ) {
+      std::cerr << myTCPServer.latency_report();
+      last_latency = std::chrono::steady_clock::now();
+    }
   }
 
   std::cerr << "\n[N] Main Loop Exit.. Starting Shutdown..\n";
 
   return 0;
 }
+#endif // TCP_EPOLL_SERVER_NO_MAIN